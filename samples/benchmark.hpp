@@ -0,0 +1,39 @@
+#pragma once
+
+#include "engine.hpp"
+#include <chrono>
+#include <random>
+
+// Helpers shared by the benchmark programs
+
+// Runs pass the given number of times over a grid of cells cells and
+// returns the cells processed per second
+template <typename F>
+double cells_per_second(uint64_t cells, uint32_t passes, F pass)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t k = 0; k < passes; k++)
+    {
+        pass();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (double)cells * passes / elapsed.count();
+}
+
+// Fills the grid with a mix of the three species at roughly 40% occupancy
+inline void populate(simulation_t &simulation)
+{
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> dis(0, 9);
+    grid_t &grid = simulation.current;
+    for (uint32_t i = 0; i < grid.rows; i++)
+    {
+        for (uint32_t j = 0; j < grid.cols; j++)
+        {
+            int r = dis(gen);
+            size_t idx = grid.index(i, j);
+            grid.type[idx] = r < 3 ? plant : r == 3 ? herbivore : empty;
+            grid.energy[idx] = grid.type[idx] == herbivore ? INITIAL_ENERGY : 0;
+        }
+    }
+}
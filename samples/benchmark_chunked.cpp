@@ -0,0 +1,81 @@
+#include "chunked_world.hpp"
+#include <chrono>
+#include <iostream>
+
+// Worlds checked against simulation_t: not multiples of the chunk size, so
+// the edges of the world fall inside chunks
+static const uint32_t CHECK_ROWS = 450;
+static const uint32_t CHECK_COLS = 700;
+static const uint32_t CHECK_STEPS = 60;
+
+static const uint32_t BENCHMARK_SIZE = 100000;
+static const uint32_t BENCHMARK_COLONIES = 32;
+static const uint32_t BENCHMARK_COLONY_SIZE = 200;
+static const uint32_t BENCHMARK_STEPS = 20;
+
+// Steps a chunked world and a simulation_t from the same initial entities
+// and returns whether their grids match after every tick
+bool check(thread_pool_t &pool, uint32_t plants, uint32_t herbivores, uint32_t carnivores)
+{
+    simulation_t simulation;
+    simulation.reset(CHECK_ROWS, CHECK_COLS, 7);
+    simulation.populate(pool, plants, herbivores, carnivores);
+    chunked_world_t world;
+    world.reset(CHECK_ROWS, CHECK_COLS, 7);
+    world.populate(plants, herbivores, carnivores);
+
+    for (uint32_t k = 0; k < CHECK_STEPS; k++)
+    {
+        simulation.step(pool);
+        world.step(pool);
+        if (world.region(0, 0, CHECK_ROWS, CHECK_COLS).checksum() != simulation.current.checksum() ||
+            world.changed_cells != simulation.changed_cells)
+        {
+            std::cout << "chunked world differs from simulation_t at tick " << world.tick << "\n";
+            return false;
+        }
+    }
+    std::cout << plants << "/" << herbivores << "/" << carnivores << ": identical for " << CHECK_STEPS << " ticks, " << world.chunks.size() << " chunks\n";
+    return true;
+}
+
+int main()
+{
+    thread_pool_t pool;
+    uint32_t cells = CHECK_ROWS * CHECK_COLS;
+    if (!check(pool, cells / 200, cells / 400, cells / 1000) || !check(pool, cells / 4, cells / 10, cells / 40))
+    {
+        return 1;
+    }
+
+    // A few crowded colonies in a world of ten billion cells, which as one
+    // grid would take about 50 GB per generation
+    chunked_world_t world;
+    world.reset(BENCHMARK_SIZE, BENCHMARK_SIZE, 42);
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<uint32_t> corner(0, BENCHMARK_SIZE - BENCHMARK_COLONY_SIZE);
+    std::uniform_int_distribution<> dis(0, 9);
+    for (uint32_t colony = 0; colony < BENCHMARK_COLONIES; colony++)
+    {
+        uint32_t top = corner(gen);
+        uint32_t left = corner(gen);
+        for (uint32_t i = top; i < top + BENCHMARK_COLONY_SIZE; i++)
+        {
+            for (uint32_t j = left; j < left + BENCHMARK_COLONY_SIZE; j++)
+            {
+                int r = dis(gen);
+                world.set(i, j, r < 3 ? plant : r == 3 ? herbivore : r == 4 ? carnivore : empty);
+            }
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t k = 0; k < BENCHMARK_STEPS; k++)
+    {
+        world.step(pool);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << BENCHMARK_SIZE << "x" << BENCHMARK_SIZE << ": " << elapsed.count() * 1000 / BENCHMARK_STEPS << " ms/tick, "
+              << world.population << " entities in " << world.chunks.size() << " chunks, " << world.bytes() / (1 << 20) << " MB\n";
+    return 0;
+}
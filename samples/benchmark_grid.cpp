@@ -0,0 +1,81 @@
+#include "benchmark.hpp"
+#include <iostream>
+#include <mutex>
+
+// Layout used before grid_t: one heap block per row, fields interleaved per cell
+struct legacy_entity_t
+{
+    entity_type_t type;
+    int32_t energy;
+    int32_t age;
+    std::mutex *m;
+};
+
+static const uint32_t BENCHMARK_ROWS = 4096;
+static const uint32_t BENCHMARK_COLS = 4096;
+static const uint32_t BENCHMARK_PASSES = 20;
+static const int32_t MAXIMUM_AGE = 1000;
+
+int main()
+{
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> dis(0, 3);
+
+    std::vector<std::vector<legacy_entity_t>> legacy(BENCHMARK_ROWS, std::vector<legacy_entity_t>(BENCHMARK_COLS, {empty, 0, 0, nullptr}));
+    grid_t grid;
+    grid.reset(BENCHMARK_ROWS, BENCHMARK_COLS);
+    for (uint32_t i = 0; i < BENCHMARK_ROWS; i++)
+    {
+        for (uint32_t j = 0; j < BENCHMARK_COLS; j++)
+        {
+            entity_type_t type = (entity_type_t)dis(gen);
+            legacy[i][j].type = type;
+            legacy[i][j].energy = 100;
+            grid.type[grid.index(i, j)] = type;
+            grid.energy[grid.index(i, j)] = 100;
+        }
+    }
+
+    // The aging and death pass of /next-iteration, on both layouts
+    double legacy_rate = cells_per_second((uint64_t)BENCHMARK_ROWS * BENCHMARK_COLS, BENCHMARK_PASSES, [&]()
+                                          {
+        for (uint32_t i = 0; i < BENCHMARK_ROWS; i++)
+        {
+            for (uint32_t j = 0; j < BENCHMARK_COLS; j++)
+            {
+                legacy_entity_t &e = legacy[i][j];
+                if (e.type != empty)
+                {
+                    if (e.age == MAXIMUM_AGE || e.energy == 0)
+                    {
+                        e.type = empty;
+                        e.age = 0;
+                    }
+                    else
+                    {
+                        e.age++;
+                    }
+                }
+            }
+        } });
+
+    double grid_rate = cells_per_second((uint64_t)BENCHMARK_ROWS * BENCHMARK_COLS, BENCHMARK_PASSES, [&]()
+                                        {
+        for (uint32_t i = 0; i < BENCHMARK_ROWS; i++)
+        {
+            entity_type_t *type = &grid.type[grid.index(i, 0)];
+            int16_t *energy = &grid.energy[grid.index(i, 0)];
+            int16_t *age = &grid.age[grid.index(i, 0)];
+            for (uint32_t j = 0; j < BENCHMARK_COLS; j++)
+            {
+                bool alive = type[j] != empty;
+                bool dies = alive && (age[j] == MAXIMUM_AGE || energy[j] == 0);
+                type[j] = dies ? empty : type[j];
+                age[j] = dies ? 0 : age[j] + alive;
+            }
+        } });
+
+    std::cout << "vector<vector<entity_t>>: " << legacy_rate / 1e6 << " Mcells/s\n";
+    std::cout << "grid_t (struct of arrays): " << grid_rate / 1e6 << " Mcells/s\n";
+    return 0;
+}
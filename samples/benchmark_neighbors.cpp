@@ -0,0 +1,112 @@
+#include "benchmark.hpp"
+#include <chrono>
+#include <iostream>
+
+static const uint32_t BENCHMARK_ROWS = 2048;
+static const uint32_t BENCHMARK_COLS = 2048;
+static const uint32_t BENCHMARK_PASSES = 20;
+static const uint32_t BENCHMARK_STEPS = 20;
+
+// Neighbour lookup used before the neighbour tables: bounds checks on every
+// access, and no neighbour past the grid's edges
+bool legacy_neighbor(const grid_t &grid, size_t idx, direction_t dir, size_t &out)
+{
+    uint32_t i = (uint32_t)(idx / grid.stride);
+    uint32_t j = (uint32_t)(idx % grid.stride);
+    switch (dir)
+    {
+    case up:
+        if (i == 0)
+            return false;
+        out = idx - grid.stride;
+        return true;
+    case down:
+        if (i + 1 >= grid.rows)
+            return false;
+        out = idx + grid.stride;
+        return true;
+    case left:
+        if (j == 0)
+            return false;
+        out = idx - 1;
+        return true;
+    default:
+        if (j + 1 >= grid.cols)
+            return false;
+        out = idx + 1;
+        return true;
+    }
+}
+
+int main()
+{
+    static const direction_t order[4] = {up, left, right, down};
+    for (topology_t topology : {bounded, toroidal})
+    {
+        simulation_t simulation;
+        simulation.reset(BENCHMARK_ROWS, BENCHMARK_COLS, 42, topology);
+        populate(simulation);
+        const grid_t &grid = simulation.current;
+
+        // The neighbour scan of claim_winner: the strongest neighbour of
+        // every cell, visited in the resolve pass's order
+        uint64_t legacy_sum = 0;
+        double legacy_rate = cells_per_second((uint64_t)BENCHMARK_ROWS * BENCHMARK_COLS, BENCHMARK_PASSES, [&]()
+                                              {
+            for (uint32_t i = 0; i < BENCHMARK_ROWS; i++)
+            {
+                for (size_t idx = grid.index(i, 0); idx < grid.index(i, BENCHMARK_COLS); idx++)
+                {
+                    entity_type_t best = empty;
+                    for (direction_t d : order)
+                    {
+                        size_t n;
+                        if (legacy_neighbor(grid, idx, d, n) && grid.type[n] > best)
+                        {
+                            best = grid.type[n];
+                        }
+                    }
+                    legacy_sum += best;
+                }
+            } });
+
+        uint64_t table_sum = 0;
+        double table_rate = cells_per_second((uint64_t)BENCHMARK_ROWS * BENCHMARK_COLS, BENCHMARK_PASSES, [&]()
+                                             {
+            for (uint32_t i = 0; i < BENCHMARK_ROWS; i++)
+            {
+                for (size_t idx = grid.index(i, 0); idx < grid.index(i, BENCHMARK_COLS); idx++)
+                {
+                    entity_type_t best = empty;
+                    for (direction_t d : order)
+                    {
+                        size_t n = simulation.neighbor(idx, d);
+                        if (grid.type[n] > best)
+                        {
+                            best = grid.type[n];
+                        }
+                    }
+                    table_sum += best;
+                }
+            } });
+
+        thread_pool_t pool(1);
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t k = 0; k < BENCHMARK_STEPS; k++)
+        {
+            simulation.step(pool);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        const char *name = topology == toroidal ? "toroidal" : "bounded";
+        std::cout << name << ": bounds-checked neighbours " << legacy_rate / 1e6 << " Mcells/s, neighbour tables " << table_rate / 1e6 << " Mcells/s";
+        // Only a bounded grid's edges match the bounds-checked lookup
+        if (topology == bounded && legacy_sum != table_sum)
+        {
+            std::cout << "\nneighbour tables disagree with the bounds-checked lookup\n";
+            return 1;
+        }
+        std::cout << ", step " << elapsed.count() * 1000 / BENCHMARK_STEPS << " ms/tick on one thread\n";
+    }
+    return 0;
+}
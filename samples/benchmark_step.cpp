@@ -0,0 +1,36 @@
+#include "benchmark.hpp"
+#include <chrono>
+#include <iostream>
+
+static const uint32_t BENCHMARK_ROWS = 2048;
+static const uint32_t BENCHMARK_COLS = 2048;
+static const uint32_t BENCHMARK_STEPS = 20;
+
+int main()
+{
+    // Step throughput and final grid checksum for 1, 2, 4, ... workers up to the hardware concurrency
+    for (unsigned workers = 1;; workers *= 2)
+    {
+        workers = std::min(workers, thread_pool_t::default_concurrency());
+        thread_pool_t pool(workers);
+        simulation_t simulation;
+        simulation.reset(BENCHMARK_ROWS, BENCHMARK_COLS, 42);
+        populate(simulation);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t k = 0; k < BENCHMARK_STEPS; k++)
+        {
+            simulation.step(pool);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double rate = (double)BENCHMARK_ROWS * BENCHMARK_COLS * BENCHMARK_STEPS / elapsed.count();
+        // The checksum must not change with the number of workers
+        std::cout << workers << " workers: " << rate / 1e6 << " Mcells/s, checksum " << std::hex << simulation.current.checksum() << std::dec << "\n";
+
+        if (workers == thread_pool_t::default_concurrency())
+        {
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "driver.hpp"
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+static const uint32_t STRESS_RESTARTS = 2000;
+static const uint32_t STRESS_STEPS = 5;
+static const uint32_t STRESS_MAXIMUM_ROWS = 256;
+// RSS may still grow while the allocator warms up; after that it must stay flat
+static const uint32_t STRESS_WARMUP = 200;
+static const long STRESS_RSS_TOLERANCE_KB = 1024;
+
+// Resident set size of this process, from /proc/self/statm
+long resident_kb()
+{
+    long pages = 0;
+    long resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main()
+{
+    // Restarts sessions over and over with varying sizes, like many clients
+    // hitting /start-simulation, and checks that memory does not grow
+    simulation_driver_t driver;
+    driver.start([](session_id_t, const snapshot_ptr &) {});
+    session_ptr session = driver.find(DEFAULT_SESSION);
+
+    long baseline = 0;
+    long peak = 0;
+    for (uint32_t k = 0; k < STRESS_RESTARTS; k++)
+    {
+        uint32_t rows = 16 + k * 37 % (STRESS_MAXIMUM_ROWS - 16);
+        uint32_t cells = rows * rows;
+        simulation_config_t config{rows, rows, k, cells / 4, cells / 10, cells / 40, 2};
+        driver.restart(session, config).get();
+        driver.advance(session, STRESS_STEPS).get();
+
+        // A second session, created and removed on every round
+        session_ptr extra = driver.create();
+        driver.restart(extra, config).get();
+        driver.remove(extra->id);
+
+        long rss = resident_kb();
+        if (k == STRESS_WARMUP)
+        {
+            baseline = rss;
+        }
+        peak = std::max(peak, rss);
+    }
+
+    long final_rss = resident_kb();
+    std::cout << STRESS_RESTARTS << " restarts: RSS " << baseline << " kB after warm-up, " << final_rss << " kB at the end, peak " << peak << " kB\n";
+    if (final_rss - baseline > STRESS_RSS_TOLERANCE_KB)
+    {
+        std::cout << "RSS grew by " << final_rss - baseline << " kB\n";
+        return 1;
+    }
+    return 0;
+}
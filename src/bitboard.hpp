@@ -0,0 +1,184 @@
+#pragma once
+
+#include "grid.hpp"
+#include <cstdint>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// One bit per cell and per type, 64 cells of a row to a word, for the types
+// the plan pass looks for around an entity: empty cells, plants and
+// herbivores. Bits past the last column are always clear, and so is a ghost
+// row after the last row, so past the edges of a bounded grid there is "no
+// such neighbour". Neighbour rows and the bits carried across word
+// boundaries come from tables set up for the topology, so finding the
+// neighbours of a word takes no branches.
+struct bitboard_t
+{
+    // Planes kept, indexed by entity_type_t
+    static const uint32_t PLANES = 3;
+
+    // Where the bits shifted into a word from its left and right come from:
+    // bit left_bit of word left_word, and bit right_bit of word right_word,
+    // which lands on bit last (the word's last column). A mask of 0 stands
+    // for the edge of a bounded grid.
+    struct word_link_t
+    {
+        uint32_t left_word;
+        uint32_t right_word;
+        uint64_t left_mask;
+        uint64_t right_mask;
+        uint8_t left_bit;
+        uint8_t right_bit;
+        uint8_t last;
+    };
+
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint32_t words = 0;
+    std::vector<uint64_t> planes[PLANES];
+    // The rows above and below each row; rows (the ghost row) past the edge
+    // of a bounded grid
+    std::vector<uint32_t> up_row;
+    std::vector<uint32_t> down_row;
+    std::vector<word_link_t> links;
+
+    void reset(uint32_t num_rows, uint32_t num_cols, topology_t topology = bounded)
+    {
+        rows = num_rows;
+        cols = num_cols;
+        words = (num_cols + 63) / 64;
+        for (std::vector<uint64_t> &plane : planes)
+        {
+            plane.assign(((size_t)rows + 1) * words, 0);
+        }
+
+        bool wraps = topology == toroidal;
+        up_row.resize(rows);
+        down_row.resize(rows);
+        for (uint32_t i = 0; i < rows; i++)
+        {
+            up_row[i] = i > 0 ? i - 1 : wraps ? rows - 1 : rows;
+            down_row[i] = i + 1 < rows ? i + 1 : wraps ? 0 : rows;
+        }
+        links.resize(words);
+        for (uint32_t w = 0; w < words; w++)
+        {
+            word_link_t &link = links[w];
+            bool leftmost = w == 0;
+            bool rightmost = w + 1 == words;
+            link.left_word = !leftmost ? w - 1 : wraps ? words - 1 : 0;
+            link.left_bit = (uint8_t)(!leftmost ? 63 : (cols - 1) % 64);
+            link.left_mask = !leftmost || wraps ? 1 : 0;
+            link.right_word = !rightmost ? w + 1 : 0;
+            link.right_bit = 0;
+            link.right_mask = !rightmost || wraps ? 1 : 0;
+            link.last = (uint8_t)(!rightmost ? 63 : (cols - 1) % 64);
+        }
+    }
+
+    const uint64_t *row(uint32_t type, uint32_t i) const
+    {
+        return &planes[type][(size_t)i * words];
+    }
+
+    // Bits of word w that fall inside the grid
+    uint64_t valid(uint32_t w) const
+    {
+        uint32_t width = std::min<uint32_t>(64, cols - w * 64);
+        return width == 64 ? ~0ULL : (1ULL << width) - 1;
+    }
+
+    // Cells of word w of row i that hold an entity of any type
+    uint64_t occupied(uint32_t i, uint32_t w) const
+    {
+        return ~row(empty, i)[w] & valid(w);
+    }
+
+    // Rebuilds the words of rows [row_begin, row_end) from the grid
+    void build(const grid_t &grid, uint32_t row_begin, uint32_t row_end)
+    {
+        for (uint32_t i = row_begin; i < row_end; i++)
+        {
+            const entity_type_t *types = &grid.type[grid.index(i, 0)];
+            for (uint32_t w = 0; w < words; w++)
+            {
+                uint64_t bits[4];
+                match(types, w * 64, std::min(grid.cols, w * 64 + 64), grid.stride, bits);
+                for (uint32_t type = 0; type < PLANES; type++)
+                {
+                    planes[type][(size_t)i * words + w] = bits[type];
+                }
+            }
+        }
+    }
+
+    // Sets bits[t] to the cells of [begin, end) of a row (at most 64) that
+    // hold type t
+    static void match(const entity_type_t *types, uint32_t begin, uint32_t end, [[maybe_unused]] uint32_t stride, uint64_t bits[4])
+    {
+        bits[0] = bits[1] = bits[2] = bits[3] = 0;
+        uint32_t j = begin;
+#ifdef __AVX2__
+        // 32 cells per compare; loads stay within the row's stride padding
+        for (; j + 32 <= end || (j + 32 <= stride && j < end); j += 32)
+        {
+            __m256i cells = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(types + j));
+            for (uint32_t type = 0; type < PLANES; type++)
+            {
+                uint32_t found = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, _mm256_set1_epi8((char)type)));
+                bits[type] |= (uint64_t)found << (j - begin);
+            }
+        }
+#endif
+        for (; j < end; j++)
+        {
+            bits[types[j]] |= 1ULL << (j - begin);
+        }
+        // Clear anything read past the last column
+        uint32_t width = end - begin;
+        if (width < 64)
+        {
+            for (uint32_t type = 0; type < 4; type++)
+            {
+                bits[type] &= (1ULL << width) - 1;
+            }
+        }
+    }
+
+    // Moves cell (i, j) from the plane of type from to that of type to
+    void set(uint32_t i, uint32_t j, entity_type_t from, entity_type_t to)
+    {
+        uint64_t bit = 1ULL << (j % 64);
+        size_t word = (size_t)i * words + j / 64;
+        if (from < PLANES)
+        {
+            planes[from][word] &= ~bit;
+        }
+        if (to < PLANES)
+        {
+            planes[to][word] |= bit;
+        }
+    }
+
+    // Masks of the cells in word w of row i whose up, down, left and right
+    // neighbour (indexed by direction_t) holds type: whole words at a time,
+    // shifting in the bit from the linked word across word boundaries
+    void neighbors(uint32_t type, uint32_t i, uint32_t w, uint64_t out[4]) const
+    {
+        const uint64_t *center = row(type, i);
+        const word_link_t &link = links[w];
+        out[0] = row(type, up_row[i])[w];
+        out[1] = row(type, down_row[i])[w];
+        out[2] = center[w] << 1 | (center[link.left_word] >> link.left_bit & link.left_mask);
+        out[3] = center[w] >> 1 | (center[link.right_word] >> link.right_bit & link.right_mask) << link.last;
+    }
+
+    // Gathers bit b of the four direction masks into a 4-bit mask of
+    // directions
+    static uint8_t directions(const uint64_t masks[4], uint32_t b)
+    {
+        return (uint8_t)((masks[0] >> b & 1) | (masks[1] >> b & 1) << 1 | (masks[2] >> b & 1) << 2 | (masks[3] >> b & 1) << 3);
+    }
+};
@@ -0,0 +1,409 @@
+#pragma once
+
+#include "engine.hpp"
+#include <array>
+#include <memory>
+#include <unordered_map>
+
+// Chunks are CHUNK_SIZE x CHUNK_SIZE cells. A chunk is stepped inside a
+// window that adds CHUNK_HALO cells on every side: a cell's next state
+// depends on the intents of cells up to four steps away (a claim on it can
+// be voided by an eat claim on the claimant, which can in turn be voided by
+// a carnivore eating the eater), and an intent on the occupancy one step
+// further out. Chunks are stepped CHUNK_GRAIN per task.
+const uint32_t CHUNK_SIZE = 64;
+const uint32_t CHUNK_HALO = 5;
+const uint32_t CHUNK_GRAIN = 4;
+const uint32_t CHUNK_CELLS = CHUNK_SIZE * CHUNK_SIZE;
+
+// The cells of one chunk, in the struct-of-arrays layout of grid_t but
+// without its padding: a chunk is only ever stepped through a window grid,
+// so it needs no ghost border of its own
+struct chunk_t
+{
+    std::array<entity_type_t, CHUNK_CELLS> type;
+    std::array<int16_t, CHUNK_CELLS> energy;
+    std::array<int16_t, CHUNK_CELLS> age;
+
+    static size_t index(uint32_t i, uint32_t j)
+    {
+        return (size_t)i * CHUNK_SIZE + j;
+    }
+
+    void clear()
+    {
+        type.fill(empty);
+        energy.fill(0);
+        age.fill(0);
+    }
+
+    size_t bytes() const
+    {
+        return sizeof(chunk_t);
+    }
+
+    // Number of entities of each type, indexed by entity_type_t
+    std::vector<uint64_t> census() const
+    {
+        std::vector<uint64_t> counts(4, 0);
+        for (entity_type_t cell : type)
+        {
+            counts[cell]++;
+        }
+        return counts;
+    }
+
+    // FNV-1a over the cells, like grid_t::checksum
+    uint64_t checksum() const
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t idx = 0; idx < CHUNK_CELLS; idx++)
+        {
+            uint64_t cell = (uint64_t)type[idx] | (uint64_t)(uint16_t)energy[idx] << 8 | (uint64_t)(uint16_t)age[idx] << 24;
+            hash = (hash ^ cell) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    entity_t at(uint32_t i, uint32_t j) const
+    {
+        size_t idx = index(i, j);
+        return {type[idx], energy[idx], age[idx]};
+    }
+};
+
+// Chunks keyed by chunk row << 32 | chunk column, with the cells past the
+// world's edge empty. Chunks are shared with published snapshots, so a
+// chunk that may be shared is replaced rather than modified.
+using chunk_map_t = std::unordered_map<uint64_t, std::shared_ptr<chunk_t>>;
+
+inline uint64_t chunk_key(uint32_t chunk_row, uint32_t chunk_col)
+{
+    return (uint64_t)chunk_row << 32 | chunk_col;
+}
+
+// Copies the cells of a rows x cols world of chunks, from (row, col) on,
+// into grid; cells of missing chunks, and past the world's edge, are left
+// as they are
+inline void copy_chunks(const chunk_map_t &chunks, uint32_t rows, uint32_t cols, grid_t &grid, uint32_t row, uint32_t col)
+{
+    uint32_t row_end = std::min<uint64_t>(rows, (uint64_t)row + grid.rows);
+    uint32_t col_end = std::min<uint64_t>(cols, (uint64_t)col + grid.cols);
+    for (uint32_t chunk_row = row / CHUNK_SIZE; chunk_row * CHUNK_SIZE < row_end; chunk_row++)
+    {
+        for (uint32_t chunk_col = col / CHUNK_SIZE; chunk_col * CHUNK_SIZE < col_end; chunk_col++)
+        {
+            auto found = chunks.find(chunk_key(chunk_row, chunk_col));
+            if (found == chunks.end())
+            {
+                continue;
+            }
+            const chunk_t &chunk = *found->second;
+            uint32_t i_begin = std::max(row, chunk_row * CHUNK_SIZE);
+            uint32_t i_end = std::min(row_end, chunk_row * CHUNK_SIZE + CHUNK_SIZE);
+            uint32_t j_begin = std::max(col, chunk_col * CHUNK_SIZE);
+            uint32_t j_end = std::min(col_end, chunk_col * CHUNK_SIZE + CHUNK_SIZE);
+            for (uint32_t i = i_begin; i < i_end; i++)
+            {
+                size_t from = chunk.index(i - chunk_row * CHUNK_SIZE, j_begin - chunk_col * CHUNK_SIZE);
+                size_t to = grid.index(i - row, j_begin - col);
+                std::copy_n(&chunk.type[from], j_end - j_begin, &grid.type[to]);
+                std::copy_n(&chunk.energy[from], j_end - j_begin, &grid.energy[to]);
+                std::copy_n(&chunk.age[from], j_end - j_begin, &grid.age[to]);
+            }
+        }
+    }
+}
+
+// World too large to allocate as one grid, kept as a hash map of chunks
+// that hold at least one entity. A chunk is created when an entity spreads
+// or moves into it and freed when it empties out, so memory and step time
+// follow the populated area rather than the size of the world. Random
+// streams are keyed by world coordinates, so a chunked world steps exactly
+// like a simulation_t of the same size, seed and initial grid.
+struct chunked_world_t
+{
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint64_t seed = 0;
+    uint64_t tick = 0;
+    uint64_t changed_cells = 0;
+    uint64_t population = 0;
+    uint32_t run = 0;
+    chunk_map_t chunks;
+    // Chunks taken out of the map, which snapshots may still hold, and the
+    // ones nothing holds any more, reused for new chunks. Spares are freed
+    // once retired and spare chunks outnumber the chunks in the map, which
+    // is as many as the next tick needs.
+    std::vector<std::shared_ptr<chunk_t>> retired;
+    std::vector<std::shared_ptr<chunk_t>> spare;
+
+    void reset(uint32_t num_rows, uint32_t num_cols, uint64_t world_seed)
+    {
+        rows = num_rows;
+        cols = num_cols;
+        seed = world_seed;
+        tick = 0;
+        changed_cells = 0;
+        population = 0;
+        run = next_run();
+        chunks.clear();
+        retired.clear();
+        spare.clear();
+    }
+
+    uint32_t chunk_rows() const
+    {
+        return (rows + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+
+    uint32_t chunk_cols() const
+    {
+        return (cols + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+
+    // Memory held by the chunks, in the map, retired or spare
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (const auto &entry : chunks)
+        {
+            total += entry.second->bytes();
+        }
+        for (const std::vector<std::shared_ptr<chunk_t>> *list : {&retired, &spare})
+        {
+            for (const std::shared_ptr<chunk_t> &chunk : *list)
+            {
+                total += chunk->bytes();
+            }
+        }
+        return total;
+    }
+
+    entity_t at(uint32_t i, uint32_t j) const
+    {
+        auto found = chunks.find(chunk_key(i / CHUNK_SIZE, j / CHUNK_SIZE));
+        if (found == chunks.end())
+        {
+            return {empty, 0, 0};
+        }
+        return found->second->at(i % CHUNK_SIZE, j % CHUNK_SIZE);
+    }
+
+    // Puts a new entity of the given type at (i, j), creating its chunk if
+    // needed. Does not keep population up to date.
+    void set(uint32_t i, uint32_t j, entity_type_t type)
+    {
+        uint64_t key = chunk_key(i / CHUNK_SIZE, j / CHUNK_SIZE);
+        auto found = chunks.find(key);
+        if (found == chunks.end())
+        {
+            if (type == empty)
+            {
+                return;
+            }
+            found = chunks.emplace(key, spare_chunk()).first;
+        }
+        else if (found->second.use_count() > 1)
+        {
+            found->second = std::make_shared<chunk_t>(*found->second);
+        }
+        chunk_t &chunk = *found->second;
+        size_t idx = chunk.index(i % CHUNK_SIZE, j % CHUNK_SIZE);
+        chunk.type[idx] = type;
+        chunk.energy[idx] = type == plant || type == empty ? 0 : INITIAL_ENERGY;
+        chunk.age[idx] = 0;
+    }
+
+    // Scatters the initial entities like simulation_t::populate, so both
+    // place them on the same cells
+    void populate(uint32_t plants, uint32_t herbivores, uint32_t carnivores)
+    {
+        index_permutation_t cells(tick_key(seed, ~0ULL), (uint64_t)rows * cols);
+        uint64_t herbivores_begin = plants;
+        uint64_t carnivores_begin = herbivores_begin + herbivores;
+        uint64_t total = carnivores_begin + carnivores;
+        for (uint64_t n = 0; n < total; n++)
+        {
+            uint64_t cell = cells(n);
+            set((uint32_t)(cell / cols), (uint32_t)(cell % cols), n < herbivores_begin ? plant : n < carnivores_begin ? herbivore : carnivore);
+        }
+        population = total;
+    }
+
+    // Copies the cells of a rectangle of the world into a grid, for display
+    grid_t region(uint32_t row, uint32_t col, uint32_t num_rows, uint32_t num_cols) const
+    {
+        grid_t grid;
+        grid.reset(num_rows, num_cols);
+        copy_chunks(chunks, rows, cols, grid, row, col);
+        return grid;
+    }
+
+    // Advances one tick. Every allocated chunk is stepped, and so is every
+    // missing one next to an allocated chunk with an entity on the facing
+    // edge, since only those can receive an entity. Each chunk is worked out
+    // on its own from a window of the current generation into a fresh
+    // chunk, so chunks run in parallel; the map is only changed once all of
+    // them are done.
+    void step(thread_pool_t &pool, unsigned concurrency = ~0u)
+    {
+        std::vector<uint64_t> keys;
+        keys.reserve(chunks.size());
+        for (const auto &entry : chunks)
+        {
+            keys.push_back(entry.first);
+            uint32_t chunk_row = (uint32_t)(entry.first >> 32);
+            uint32_t chunk_col = (uint32_t)entry.first;
+            static const direction_t directions[4] = {up, down, left, right};
+            for (direction_t d : directions)
+            {
+                if ((d == up && chunk_row == 0) || (d == down && chunk_row + 1 == chunk_rows()) ||
+                    (d == left && chunk_col == 0) || (d == right && chunk_col + 1 == chunk_cols()))
+                {
+                    continue;
+                }
+                uint64_t neighbor = chunk_key(chunk_row + (d == down) - (d == up), chunk_col + (d == right) - (d == left));
+                if (chunks.count(neighbor) == 0 && edge_occupied(*entry.second, d))
+                {
+                    keys.push_back(neighbor);
+                }
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        reclaim();
+        std::vector<std::shared_ptr<chunk_t>> results(keys.size());
+        for (std::shared_ptr<chunk_t> &result : results)
+        {
+            result = spare_chunk();
+        }
+        std::vector<tile_stats_t> stats(keys.size());
+        pool.parallel_for((uint32_t)keys.size(), CHUNK_GRAIN, [&](uint32_t begin, uint32_t end)
+                          {
+            for (uint32_t k = begin; k < end; k++)
+            {
+                stats[k] = step_chunk(pool, keys[k], *results[k]);
+            } }, concurrency);
+
+        changed_cells = 0;
+        population = 0;
+        for (size_t k = 0; k < keys.size(); k++)
+        {
+            changed_cells += stats[k].changes;
+            population += stats[k].population;
+            auto found = chunks.find(keys[k]);
+            if (found != chunks.end())
+            {
+                retired.push_back(std::move(found->second));
+            }
+            if (stats[k].population == 0)
+            {
+                retired.push_back(std::move(results[k]));
+                if (found != chunks.end())
+                {
+                    chunks.erase(found);
+                }
+            }
+            else
+            {
+                chunks[keys[k]] = std::move(results[k]);
+            }
+        }
+        reclaim();
+        spare.resize(std::min(spare.size(), chunks.size() - std::min(chunks.size(), retired.size())));
+        tick++;
+    }
+
+private:
+    // Moves the retired chunks that nothing shares any more to spare
+    void reclaim()
+    {
+        size_t kept = 0;
+        for (std::shared_ptr<chunk_t> &chunk : retired)
+        {
+            if (chunk.use_count() == 1)
+            {
+                spare.push_back(std::move(chunk));
+            }
+            else
+            {
+                retired[kept++] = std::move(chunk);
+            }
+        }
+        retired.resize(kept);
+    }
+
+    // A cleared chunk: a spare one, or a new one
+    std::shared_ptr<chunk_t> spare_chunk()
+    {
+        std::shared_ptr<chunk_t> chunk;
+        if (spare.empty())
+        {
+            chunk = std::make_shared<chunk_t>();
+        }
+        else
+        {
+            chunk = std::move(spare.back());
+            spare.pop_back();
+        }
+        chunk->clear();
+        return chunk;
+    }
+
+    // True when the edge of chunk facing direction d holds an entity
+    static bool edge_occupied(const chunk_t &chunk, direction_t d)
+    {
+        for (uint32_t k = 0; k < CHUNK_SIZE; k++)
+        {
+            size_t idx = d == up ? chunk.index(0, k) : d == down ? chunk.index(CHUNK_SIZE - 1, k) : d == left ? chunk.index(k, 0) : chunk.index(k, CHUNK_SIZE - 1);
+            if (chunk.type[idx] != empty)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Steps the chunk with the given key on the calling thread, through a
+    // scratch simulation kept per thread, and stores its next generation in
+    // out, a cleared chunk. Returns how many of its cells changed and
+    // how many hold an entity.
+    tile_stats_t step_chunk(thread_pool_t &pool, uint64_t key, chunk_t &out) const
+    {
+        thread_local simulation_t window;
+        uint32_t row_begin = (uint32_t)(key >> 32) * CHUNK_SIZE;
+        uint32_t col_begin = (uint32_t)key * CHUNK_SIZE;
+        uint32_t top = row_begin - std::min(row_begin, CHUNK_HALO);
+        uint32_t left = col_begin - std::min(col_begin, CHUNK_HALO);
+        uint32_t bottom = std::min(rows, row_begin + CHUNK_SIZE + CHUNK_HALO);
+        uint32_t right = std::min(cols, col_begin + CHUNK_SIZE + CHUNK_HALO);
+
+        window.resize(bottom - top, right - left, seed);
+        window.origin_row = top;
+        window.origin_col = left;
+        window.world_cols = cols;
+        window.tick = tick;
+        copy_chunks(chunks, rows, cols, window.current, top, left);
+        window.step_dense(pool, 1);
+
+        tile_stats_t stats{0, 0};
+        uint32_t row_end = std::min(rows, row_begin + CHUNK_SIZE);
+        uint32_t col_end = std::min(cols, col_begin + CHUNK_SIZE);
+        for (uint32_t i = row_begin; i < row_end; i++)
+        {
+            size_t from = window.current.index(i - top, col_begin - left);
+            size_t to = out.index(i - row_begin, 0);
+            std::copy_n(&window.current.type[from], col_end - col_begin, &out.type[to]);
+            std::copy_n(&window.current.energy[from], col_end - col_begin, &out.energy[to]);
+            std::copy_n(&window.current.age[from], col_end - col_begin, &out.age[to]);
+            for (uint32_t j = 0; j < col_end - col_begin; j++)
+            {
+                stats.changes += window.changed_at(from + j, tick + 1);
+                stats.population += out.type[to + j] != empty;
+            }
+        }
+        return stats;
+    }
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+// Mutex that counts its acquisitions and how many of them had to wait
+// because another thread held it. Use with std::condition_variable_any.
+class counted_mutex_t
+{
+public:
+    void lock()
+    {
+        if (!m.try_lock())
+        {
+            contended.fetch_add(1, std::memory_order_relaxed);
+            m.lock();
+        }
+        acquired.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_lock()
+    {
+        if (!m.try_lock())
+        {
+            return false;
+        }
+        acquired.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock()
+    {
+        m.unlock();
+    }
+
+    uint64_t acquisitions() const
+    {
+        return acquired.load(std::memory_order_relaxed);
+    }
+
+    uint64_t contentions() const
+    {
+        return contended.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::mutex m;
+    std::atomic<uint64_t> acquired{0};
+    std::atomic<uint64_t> contended{0};
+};
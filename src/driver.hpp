@@ -0,0 +1,741 @@
+#pragma once
+
+#include "engine.hpp"
+#include "snapshot.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parameters of a (re)started simulation
+struct simulation_config_t
+{
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint64_t seed = 0;
+    uint32_t plants = 0;
+    uint32_t herbivores = 0;
+    uint32_t carnivores = 0;
+    uint32_t workers = 1;
+    // Alternatives to the exact counts above: a map of the whole grid, or
+    // else per-cell probabilities indexed by entity_type_t, with plants
+    // optionally gathered in noise patches of about patch_scale cells
+    std::vector<entity_type_t> map = {};
+    bool use_densities = false;
+    double densities[4] = {0, 0, 0, 0};
+    double patch_scale = 0;
+    // Whether the edges wrap around
+    topology_t topology = bounded;
+    // Whether the world is kept in chunks, for a world too large for one
+    // grid; it is then populated from the exact counts only
+    bool chunked = false;
+};
+
+using snapshot_ptr = std::shared_ptr<const snapshot_t>;
+using session_id_t = uint64_t;
+
+// Called once a session command has run, with the snapshot it published, or
+// with null when the session was removed before the command ran
+using completion_t = std::function<void(const snapshot_ptr &)>;
+
+// Reports the end of a queued command exactly once: finish() passes on the
+// snapshot, and a command dropped unrun reports null when it is destroyed
+class pending_command_t
+{
+public:
+    explicit pending_command_t(completion_t callback) : done(std::move(callback))
+    {
+    }
+
+    ~pending_command_t()
+    {
+        if (done)
+        {
+            done(nullptr);
+        }
+    }
+
+    void finish(const snapshot_ptr &snapshot)
+    {
+        completion_t callback = std::move(done);
+        done = nullptr;
+        callback(snapshot);
+    }
+
+private:
+    completion_t done;
+};
+
+// The session behind the single-world endpoints
+static const session_id_t DEFAULT_SESSION = 0;
+
+// Appended to the keyframe of a spilled session: the state a keyframe does
+// not carry
+struct spill_trailer_t
+{
+    uint64_t seed;
+    uint64_t changed_cells;
+    uint32_t workers;
+    uint32_t topology;
+};
+
+// One hosted world: its simulation, or its chunked world when it is too
+// large for one grid, the last snapshot it published, and the work waiting
+// for it. Only the driver touches the simulation, and only one
+// task of a session runs at a time. A spilled session keeps its state in a
+// keyframe file instead of memory and publishes no snapshot until restored.
+class session_t
+{
+public:
+    explicit session_t(session_id_t session_id) : id(session_id), published(std::make_shared<snapshot_t>())
+    {
+    }
+
+    ~session_t()
+    {
+        if (!spill_path.empty())
+        {
+            std::remove(spill_path.c_str());
+        }
+    }
+
+    // Latest published snapshot, or null while the session is spilled
+    snapshot_ptr latest() const
+    {
+        return std::atomic_load(&published);
+    }
+
+    const session_id_t id;
+
+private:
+    friend class simulation_driver_t;
+
+    // Copies the current generation into a snapshot, reusing the previous
+    // retired one when no reader holds it any more, and swaps it in
+    snapshot_ptr publish()
+    {
+        std::shared_ptr<snapshot_t> fresh;
+        if (retired && retired.use_count() == 1)
+        {
+            fresh = std::move(retired);
+        }
+        else
+        {
+            fresh = std::make_shared<snapshot_t>();
+        }
+        fresh->chunked = chunked;
+        if (chunked)
+        {
+            fresh->grid = grid_t();
+            fresh->changed_tick.clear();
+            fresh->tick = world.tick;
+            fresh->seed = world.seed;
+            fresh->changed_cells = world.changed_cells;
+            fresh->run = world.run;
+            fresh->sparse = false;
+            fresh->tiles = 0;
+            fresh->skipped_tiles = 0;
+            fresh->plant_tiles = 0;
+            fresh->world_rows = world.rows;
+            fresh->world_cols = world.cols;
+            fresh->chunks = world.chunks;
+
+            snapshot_ptr snapshot = fresh;
+            std::atomic_store(&published, snapshot);
+            retired = std::move(live);
+            live = std::move(fresh);
+            // Let the world reuse the chunks that only the retired
+            // snapshot still holds
+            if (retired && retired.use_count() == 1)
+            {
+                retired->chunks.clear();
+            }
+            return snapshot;
+        }
+        fresh->chunks.clear();
+        fresh->grid = simulation.current;
+        fresh->changed_tick = simulation.changed_tick;
+        fresh->tick = simulation.tick;
+        fresh->seed = simulation.seed;
+        fresh->changed_cells = simulation.changed_cells;
+        fresh->run = simulation.run;
+        fresh->sparse = simulation.sparse;
+        fresh->tiles = simulation.tile_count();
+        fresh->skipped_tiles = simulation.skipped_tiles;
+        fresh->plant_tiles = simulation.plant_tiles;
+
+        snapshot_ptr snapshot = fresh;
+        std::atomic_store(&published, snapshot);
+        retired = std::move(live);
+        live = std::move(fresh);
+        return snapshot;
+    }
+
+    void step(thread_pool_t &pool)
+    {
+        if (chunked)
+        {
+            world.step(pool, workers);
+        }
+        else
+        {
+            simulation.step(pool, workers);
+        }
+    }
+
+    // Bytes held by the simulation or the chunked world, and the snapshots
+    // it recycles; chunks are shared with the snapshots and counted once
+    size_t footprint() const
+    {
+        size_t bytes = world.bytes() + simulation.current.bytes() + simulation.next.bytes() + simulation.intent.size() +
+                       simulation.changed_tick.size() * sizeof(uint32_t) + simulation.live.capacity() * sizeof(size_t);
+        for (const std::vector<uint64_t> &plane : simulation.occupancy.planes)
+        {
+            bytes += plane.size() * sizeof(uint64_t);
+        }
+        for (const snapshot_t *snapshot : {live.get(), retired.get()})
+        {
+            if (snapshot)
+            {
+                bytes += snapshot->grid.bytes() + snapshot->changed_tick.size() * sizeof(uint32_t);
+            }
+        }
+        return bytes;
+    }
+
+    // Writes the current generation to path as a keyframe and frees every
+    // buffer. Returns false, keeping the session in memory, if the write fails.
+    bool spill(const std::string &path)
+    {
+        std::string data = encode_keyframe(simulation.current, simulation.run, simulation.tick);
+        spill_trailer_t trailer{simulation.seed, simulation.changed_cells, workers, simulation.topology};
+        data.append(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out.write(data.data(), (std::streamsize)data.size());
+            if (!out.flush())
+            {
+                std::remove(path.c_str());
+                return false;
+            }
+        }
+
+        spill_path = path;
+        std::atomic_store(&published, snapshot_ptr());
+        simulation = simulation_t();
+        live.reset();
+        retired.reset();
+        return true;
+    }
+
+    // Reloads a spilled session with its seed, tick and run id intact. Every
+    // cell is stamped as changed at the restored tick, so clients that were
+    // behind get a keyframe. A missing or damaged file leaves the session
+    // empty, as if it had never been started.
+    void restore()
+    {
+        if (spill_path.empty())
+        {
+            return;
+        }
+        std::ifstream in(spill_path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::remove(spill_path.c_str());
+        spill_path.clear();
+
+        snapshot_header_t header;
+        grid_t grid;
+        spill_trailer_t trailer;
+        if (data.size() < sizeof(trailer) || !decode_keyframe(data, header, grid) ||
+            data.size() != SNAPSHOT_HEADER_SIZE + (size_t)header.count * 5 + sizeof(trailer))
+        {
+            started = false;
+            std::atomic_store(&published, snapshot_ptr(std::make_shared<snapshot_t>()));
+            return;
+        }
+        std::memcpy(&trailer, data.data() + data.size() - sizeof(trailer), sizeof(trailer));
+
+        simulation.reset(header.rows, header.cols, trailer.seed, (topology_t)trailer.topology);
+        simulation.current = std::move(grid);
+        simulation.tick = header.tick;
+        simulation.run = header.run;
+        simulation.changed_cells = trailer.changed_cells;
+        std::fill(simulation.changed_tick.begin(), simulation.changed_tick.end(), (uint32_t)header.tick);
+        workers = trailer.workers;
+    }
+
+    simulation_t simulation;
+    chunked_world_t world;
+    bool chunked = false;
+    bool started = false;
+    uint32_t workers = 1;
+    snapshot_ptr published;
+    std::shared_ptr<snapshot_t> live;
+    std::shared_ptr<snapshot_t> retired;
+
+    // Set while the session's state lives in a spill file
+    std::string spill_path;
+
+    // Guarded by the driver's mutex
+    std::deque<std::function<void()>> commands;
+    double rate = 0;
+    std::chrono::steady_clock::time_point deadline;
+    bool busy = false;
+    size_t bytes = 0;
+    bool pinned = false;
+    std::chrono::steady_clock::time_point last_used = std::chrono::steady_clock::now();
+};
+
+using session_ptr = std::shared_ptr<session_t>;
+
+// Counters of the driver as a whole
+struct driver_stats_t
+{
+    size_t sessions;
+    size_t resident_sessions;
+    size_t bytes;
+    uint64_t lock_acquisitions;
+    uint64_t lock_contentions;
+    uint64_t pool_lock_acquisitions;
+    uint64_t pool_lock_contentions;
+};
+
+// Hosts any number of sessions on one shared worker pool. A single scheduler
+// thread hands each session's pending commands and clocked ticks to the pool
+// as tasks, so different sessions step concurrently while each session steps
+// one tick at a time. After every change a session publishes an immutable
+// snapshot with an atomic pointer swap; readers take the latest snapshot
+// without ever waiting for a step in progress, and the writer never waits
+// for readers.
+//
+// With a memory budget set, the least recently used idle sessions are
+// spilled to disk, or dropped when there is no spill directory, whenever
+// the sessions together hold more than the budget. A session that is
+// streaming on its own clock is never idle.
+class simulation_driver_t
+{
+public:
+    explicit simulation_driver_t(unsigned concurrency = thread_pool_t::default_concurrency()) : pool(concurrency)
+    {
+        sessions[DEFAULT_SESSION] = std::make_shared<session_t>(DEFAULT_SESSION);
+    }
+
+    ~simulation_driver_t()
+    {
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (scheduler.joinable())
+        {
+            scheduler.join();
+        }
+    }
+
+    // Starts the scheduler thread; on_publish runs on a worker after every
+    // publish
+    void start(std::function<void(session_id_t, const snapshot_ptr &)> on_publish)
+    {
+        publish_callback = std::move(on_publish);
+        scheduler = std::thread([this]()
+                                { run_loop(); });
+    }
+
+    unsigned concurrency() const
+    {
+        return pool.concurrency();
+    }
+
+    // Caps the memory held by all sessions (0 means no cap). Evicted sessions
+    // are spilled into directory, or dropped when directory is empty.
+    void set_memory_budget(size_t budget_bytes, const std::string &directory)
+    {
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            memory_budget = budget_bytes;
+            spill_directory = directory;
+        }
+        cv.notify_all();
+    }
+
+    driver_stats_t stats()
+    {
+        driver_stats_t stats{};
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            stats.sessions = sessions.size();
+            for (auto &it : sessions)
+            {
+                stats.resident_sessions += it.second->bytes > 0;
+                stats.bytes += it.second->bytes;
+            }
+        }
+        stats.lock_acquisitions = m.acquisitions();
+        stats.lock_contentions = m.contentions();
+        stats.pool_lock_acquisitions = pool.queue_lock().acquisitions();
+        stats.pool_lock_contentions = pool.queue_lock().contentions();
+        return stats;
+    }
+
+    // Reports the latest snapshot of a session to done, right away unless
+    // the session was spilled and has to be restored first
+    void latest(const session_ptr &session, completion_t done)
+    {
+        snapshot_ptr snapshot = session->latest();
+        if (snapshot)
+        {
+            done(snapshot);
+            return;
+        }
+        submit(session, []() {}, std::move(done));
+    }
+
+    // Creates an empty session and returns it
+    session_ptr create()
+    {
+        std::lock_guard<counted_mutex_t> guard(m);
+        session_ptr session = std::make_shared<session_t>(next_id++);
+        sessions[session->id] = session;
+        return session;
+    }
+
+    session_ptr find(session_id_t id)
+    {
+        std::lock_guard<counted_mutex_t> guard(m);
+        auto it = sessions.find(id);
+        if (it == sessions.end())
+        {
+            return nullptr;
+        }
+        it->second->last_used = std::chrono::steady_clock::now();
+        return it->second;
+    }
+
+    // Removes a session; commands still queued for it are dropped
+    bool remove(session_id_t id)
+    {
+        std::lock_guard<counted_mutex_t> guard(m);
+        auto it = sessions.find(id);
+        if (it == sessions.end() || id == DEFAULT_SESSION)
+        {
+            return false;
+        }
+        erase(it);
+        return true;
+    }
+
+    std::vector<session_ptr> list()
+    {
+        std::lock_guard<counted_mutex_t> guard(m);
+        std::vector<session_ptr> all;
+        for (auto &it : sessions)
+        {
+            all.push_back(it.second);
+        }
+        return all;
+    }
+
+    // Resets the session's simulation and resolves to its first snapshot.
+    // config.workers caps how many threads step this session at once. The
+    // future fails with a future_error when the session has been removed.
+    std::future<snapshot_ptr> restart(const session_ptr &session, const simulation_config_t &config)
+    {
+        return future_of([&](completion_t done)
+                         { restart(session, config, std::move(done)); });
+    }
+
+    // Same as above, reporting the first snapshot to done instead
+    void restart(const session_ptr &session, const simulation_config_t &config, completion_t done)
+    {
+        submit(session, [this, session, config]()
+               {
+            session->workers = config.workers;
+            session->chunked = config.chunked;
+            if (config.chunked)
+            {
+                session->simulation = simulation_t();
+                session->world.reset(config.rows, config.cols, config.seed);
+                session->world.populate(config.plants, config.herbivores, config.carnivores);
+                session->started = true;
+                return;
+            }
+            session->world = chunked_world_t();
+            session->simulation.reset(config.rows, config.cols, config.seed, config.topology);
+            if (!config.map.empty())
+            {
+                session->simulation.populate_map(pool, config.map, config.workers);
+            }
+            else if (config.use_densities)
+            {
+                session->simulation.populate_densities(pool, config.densities, config.patch_scale, config.workers);
+            }
+            else
+            {
+                session->simulation.populate(pool, config.plants, config.herbivores, config.carnivores, config.workers);
+            }
+            session->started = true; }, std::move(done));
+    }
+
+    // Advances the session by steps ticks and resolves to the snapshot after
+    // the last one, or fails like restart()
+    std::future<snapshot_ptr> advance(const session_ptr &session, uint32_t steps)
+    {
+        return future_of([&](completion_t done)
+                         { advance(session, steps, std::move(done)); });
+    }
+
+    // Same as above, reporting the last snapshot to done instead
+    void advance(const session_ptr &session, uint32_t steps, completion_t done)
+    {
+        submit(session, [this, session, steps]()
+               {
+            if (!session->started)
+            {
+                return;
+            }
+            for (uint32_t k = 0; k < steps; k++)
+            {
+                session->step(pool);
+            } }, std::move(done));
+    }
+
+    // Ticks per second to advance the session on the driver's own clock: 0
+    // pauses it and a negative rate runs it as fast as possible
+    void set_rate(const session_ptr &session, double ticks_per_second)
+    {
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            session->rate = ticks_per_second;
+        }
+        cv.notify_all();
+    }
+
+private:
+    // Turns an operation that reports to a completion into a future, which
+    // fails with a future_error when the session has been removed
+    static std::future<snapshot_ptr> future_of(const std::function<void(completion_t)> &operation)
+    {
+        auto promise = std::make_shared<std::promise<snapshot_ptr>>();
+        std::future<snapshot_ptr> result = promise->get_future();
+        operation([promise](const snapshot_ptr &snapshot)
+                  {
+            if (snapshot)
+            {
+                promise->set_value(snapshot);
+            }
+            else
+            {
+                promise->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+            } });
+        return result;
+    }
+
+    // Queues command for the session; done runs on a worker with the
+    // snapshot published after it. When the session has been removed, now
+    // or before the command runs, done gets null instead, on the calling
+    // thread or with the driver's mutex held, so it must not call back into
+    // the driver.
+    void submit(const session_ptr &session, std::function<void()> command, completion_t done)
+    {
+        auto pending = std::make_shared<pending_command_t>(std::move(done));
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            auto it = sessions.find(session->id);
+            if (it == sessions.end() || it->second != session)
+            {
+                return;
+            }
+            session->commands.emplace_back([session, command, pending]()
+                                           {
+                session->restore();
+                command();
+                pending->finish(session->publish()); });
+            session->last_used = std::chrono::steady_clock::now();
+            session->pinned = false;
+        }
+        cv.notify_all();
+    }
+
+    // Takes a session out of the driver: its queued commands are dropped,
+    // reporting null to their completions, and submit() refuses any later
+    // ones. Must be
+    // called with the mutex held.
+    void erase(std::map<session_id_t, session_ptr>::iterator it)
+    {
+        it->second->commands.clear();
+        it->second->rate = 0;
+        it->second->bytes = 0;
+        sessions.erase(it);
+    }
+
+    // Runs one unit of a session's work on the pool and marks it idle again
+    void dispatch(const session_ptr &session, std::function<void()> work)
+    {
+        pool.submit([this, session, work]()
+                    {
+            work();
+            snapshot_ptr snapshot = session->latest();
+            if (publish_callback && snapshot)
+            {
+                publish_callback(session->id, snapshot);
+            }
+            size_t bytes = session->footprint();
+            {
+                std::lock_guard<counted_mutex_t> guard(m);
+                session->busy = false;
+                session->bytes = bytes;
+            }
+            cv.notify_all(); });
+    }
+
+    // Picks the least recently used idle sessions to spill or drop until the
+    // rest fit in the budget. Must be called with the mutex held.
+    void evict(std::vector<std::pair<session_ptr, std::function<void()>>> &ready)
+    {
+        size_t total = 0;
+        std::vector<session_ptr> idle;
+        for (auto &it : sessions)
+        {
+            session_ptr session = it.second;
+            total += session->bytes;
+            if (!session->busy && !session->pinned && session->commands.empty() && session->rate == 0 && session->bytes > 0 &&
+                (!spill_directory.empty() || session->id != DEFAULT_SESSION) && (!session->chunked || session->id != DEFAULT_SESSION))
+            {
+                idle.push_back(session);
+            }
+        }
+        if (total <= memory_budget)
+        {
+            return;
+        }
+
+        std::sort(idle.begin(), idle.end(), [](const session_ptr &a, const session_ptr &b)
+                  { return a->last_used < b->last_used; });
+        for (const session_ptr &session : idle)
+        {
+            if (total <= memory_budget)
+            {
+                break;
+            }
+            total -= session->bytes;
+            // A chunked world has no keyframe to spill into, so it is dropped
+            if (spill_directory.empty() || session->chunked)
+            {
+                erase(sessions.find(session->id));
+                continue;
+            }
+            session->busy = true;
+            std::string path = spill_directory + "/session-" + std::to_string(session->id) + ".ecos";
+            ready.emplace_back(session, [this, session, path]()
+                               {
+                if (!session->spill(path))
+                {
+                    // Keep it in memory rather than retrying on every pass
+                    std::lock_guard<counted_mutex_t> guard(m);
+                    session->pinned = true;
+                } });
+        }
+    }
+
+    void run_loop()
+    {
+        for (;;)
+        {
+            std::vector<std::pair<session_ptr, std::function<void()>>> ready;
+            {
+                std::unique_lock<counted_mutex_t> lock(m);
+                if (stopping)
+                {
+                    return;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                auto wake = std::chrono::steady_clock::time_point::max();
+                for (auto &it : sessions)
+                {
+                    session_ptr session = it.second;
+                    if (session->busy)
+                    {
+                        continue;
+                    }
+                    if (!session->commands.empty())
+                    {
+                        session->busy = true;
+                        ready.emplace_back(session, std::move(session->commands.front()));
+                        session->commands.pop_front();
+                        continue;
+                    }
+                    if (session->rate == 0 || !session->started)
+                    {
+                        continue;
+                    }
+                    if (session->rate < 0 || now >= session->deadline)
+                    {
+                        if (session->rate > 0)
+                        {
+                            // Keep the clock steady, but do not try to catch up on a backlog
+                            auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / session->rate));
+                            session->deadline = std::max(session->deadline + period, now);
+                        }
+                        session->busy = true;
+                        ready.emplace_back(session, [this, session]()
+                                           {
+                            session->restore();
+                            session->step(pool);
+                            session->publish(); });
+                        continue;
+                    }
+                    wake = std::min(wake, session->deadline);
+                }
+
+                if (memory_budget > 0)
+                {
+                    evict(ready);
+                }
+
+                if (ready.empty())
+                {
+                    if (wake == std::chrono::steady_clock::time_point::max())
+                    {
+                        cv.wait(lock);
+                    }
+                    else
+                    {
+                        cv.wait_until(lock, wake);
+                    }
+                    continue;
+                }
+            }
+
+            for (auto &work : ready)
+            {
+                dispatch(work.first, std::move(work.second));
+            }
+        }
+    }
+
+    thread_pool_t pool;
+    std::function<void(session_id_t, const snapshot_ptr &)> publish_callback;
+
+    counted_mutex_t m;
+    std::condition_variable_any cv;
+    std::map<session_id_t, session_ptr> sessions;
+    session_id_t next_id = DEFAULT_SESSION + 1;
+    size_t memory_budget = 0;
+    std::string spill_directory;
+    bool stopping = false;
+    std::thread scheduler;
+};
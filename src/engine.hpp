@@ -0,0 +1,946 @@
+#pragma once
+
+#include "bitboard.hpp"
+#include "grid.hpp"
+#include "rng.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <random>
+
+// Constants
+const uint32_t PLANT_MAXIMUM_AGE = 10;
+const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
+const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
+const uint32_t MAXIMUM_ENERGY = 200;
+const uint32_t INITIAL_ENERGY = 100;
+const uint32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
+const uint32_t MOVE_ENERGY_COST = 5;
+const uint32_t REPRODUCTION_ENERGY_COST = 10;
+const uint32_t HERBIVORE_EAT_ENERGY_GAIN = 30;
+const uint32_t CARNIVORE_EAT_ENERGY_GAIN = 20;
+
+// Probabilities
+const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
+const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
+const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
+const double HERBIVORE_MOVE_PROBABILITY = 0.7;
+const double HERBIVORE_EAT_PROBABILITY = 0.9;
+const double CARNIVORE_MOVE_PROBABILITY = 0.5;
+const double CARNIVORE_EAT_PROBABILITY = 1.0;
+
+// Rectangular tile handed to a worker: 64 x 256 cells, so a tile's rows and
+// the halo rows it reads above and below stay in cache
+const uint32_t TILE_ROWS = 64;
+const uint32_t TILE_COLS = 256;
+static_assert(TILE_COLS % 64 == 0, "tiles must span whole occupancy words");
+
+// Stepping switches to the sparse engine below one live entity per
+// SPARSE_ENTER_RATIO cells, and back to the dense one above one per
+// SPARSE_LEAVE_RATIO; the gap keeps it from switching back and forth.
+// Live entities are processed SPARSE_GRAIN per task.
+const uint64_t SPARSE_ENTER_RATIO = 10;
+const uint64_t SPARSE_LEAVE_RATIO = 6;
+const uint32_t SPARSE_GRAIN = 4096;
+
+// Entities placed per task when populating a grid, and the cells per
+// entity below which placement sweeps every cell instead of scattering
+const uint32_t PLACEMENT_GRAIN = 1 << 16;
+const uint64_t PLACEMENT_SWEEP_RATIO = 4;
+
+// Neighbour directions; the opposite of a direction is d ^ 1
+enum direction_t : uint8_t
+{
+    up,
+    down,
+    left,
+    right
+};
+
+// What an entity decided to do this tick, packed as action | direction << 3
+enum action_t : uint8_t
+{
+    stay,
+    die,
+    spawn,
+    move,
+    eat
+};
+
+inline uint8_t make_intent(action_t action, direction_t dir)
+{
+    return (uint8_t)(action | dir << 3);
+}
+
+inline action_t intent_action(uint8_t intent)
+{
+    return (action_t)(intent & 7);
+}
+
+inline direction_t intent_direction(uint8_t intent)
+{
+    return (direction_t)(intent >> 3);
+}
+
+inline double reproduction_probability(entity_type_t type)
+{
+    return type == plant ? PLANT_REPRODUCTION_PROBABILITY : type == herbivore ? HERBIVORE_REPRODUCTION_PROBABILITY : CARNIVORE_REPRODUCTION_PROBABILITY;
+}
+
+inline uint32_t maximum_age(entity_type_t type)
+{
+    switch (type)
+    {
+    case plant:
+        return PLANT_MAXIMUM_AGE;
+    case herbivore:
+        return HERBIVORE_MAXIMUM_AGE;
+    case carnivore:
+        return CARNIVORE_MAXIMUM_AGE;
+    default:
+        return 0;
+    }
+}
+
+// Draws a run id from a process-wide counter, shared by every kind of
+// world so that no two runs of a process have the same id
+inline uint32_t next_run()
+{
+    static std::atomic<uint32_t> runs{0};
+    return ++runs;
+}
+
+// One cell's values, as computed by the resolve pass
+struct cell_state_t
+{
+    entity_type_t type;
+    int16_t energy;
+    int16_t age;
+};
+
+// A cell and the state it takes in the next generation
+struct cell_change_t
+{
+    size_t idx;
+    cell_state_t state;
+};
+
+// How the dense engine handles a tile in a tick
+enum tile_mode_t : uint8_t
+{
+    tile_full,
+    tile_quiet,
+    tile_plants
+};
+
+struct tile_stats_t
+{
+    uint32_t changes;
+    uint32_t population;
+};
+
+struct tile_t
+{
+    uint32_t row_begin;
+    uint32_t row_end;
+    uint32_t col_begin;
+    uint32_t col_end;
+};
+
+// Double-buffered step engine.
+//
+// A tick runs in two passes that only read the current generation:
+//  1. plan: every entity records its intent (die, spawn, move or eat, each
+//     aimed at one neighbour)
+//  2. resolve: every cell computes its own next state from its own intent
+//     and the intents aimed at it, and writes it into the next generation
+// Each pass writes only to the cell being visited, so tiles are processed
+// in parallel without locks.
+//
+// Conflicts are settled by fixed rules, in this order:
+//  - predators act before prey: a herbivore eaten by a carnivore, or a plant
+//    eaten by a herbivore, is removed and its own intent is void
+//  - among claims on the same prey or the same empty cell, carnivores beat
+//    herbivores beat plants, and ties go to the first claimant in a fixed
+//    direction order: the neighbour above, then left, right and below. On a
+//    bounded grid that is the lowest cell index; across a toroidal wrap it
+//    is not (at row 0 the neighbour "above" is in the last row)
+//  - an entity whose claim loses stays where it is and pays nothing
+struct simulation_t
+{
+    grid_t current;
+    grid_t next;
+    // Where the empty cells, plants and herbivores of the current generation
+    // are, rebuilt at the start of every tick for the plan pass
+    bitboard_t occupancy;
+    std::vector<uint8_t> intent;
+    // Tick at which each cell last took a new value, so "did this cell change
+    // in tick t" is one comparison and needs one word per cell
+    std::vector<uint32_t> changed_tick;
+    std::vector<tile_stats_t> tile_stats;
+    // Dense engine tile state: how each tile is handled this tick, whether
+    // it holds no entity, and whether it is known to be empty in the other
+    // buffer. skipped_tiles and plant_tiles count the tiles of the last
+    // tick that were skipped or only aged.
+    std::vector<tile_mode_t> tile_modes;
+    std::vector<uint8_t> tile_vacant;
+    std::vector<uint8_t> next_vacant;
+    uint32_t skipped_tiles = 0;
+    uint32_t plant_tiles = 0;
+    // Live entities in the last tick, or ~0 when not known yet
+    uint64_t population = ~0ULL;
+    // Sparse engine state: grid indices of the live entities, and the
+    // changes each chunk of them makes in a tick
+    bool sparse = false;
+    std::vector<size_t> live;
+    std::vector<std::vector<cell_change_t>> chunk_changes;
+    uint64_t changed_cells = 0;
+    uint64_t tick = 0;
+    uint64_t seed = 0;
+    // Where the grid sits in the world its random streams are keyed by: the
+    // grid itself, unless it is a window onto a larger chunked world
+    uint64_t origin_row = 0;
+    uint64_t origin_col = 0;
+    uint64_t world_cols = 0;
+    // The neighbour of cell (i, j) in direction d is the cell at
+    // neighbor_rows[i * 4 + d] + neighbor_cols[j * 4 + d]: a table lookup
+    // whatever the topology, with a bounded grid's edges pointing into its
+    // ghost border. Rows come from cell indices through stride_inverse, a
+    // fixed-point reciprocal of the stride, instead of a division.
+    topology_t topology = bounded;
+    std::vector<size_t> neighbor_rows;
+    std::vector<uint32_t> neighbor_cols;
+    uint64_t stride_inverse = 0;
+    // Drawn from a process-wide counter on every reset, so clients can tell
+    // runs apart even across sessions
+    uint32_t run = 0;
+
+    // Same seed, grid size and populations give bit-identical runs,
+    // regardless of how many workers step them
+    void reset(uint32_t rows, uint32_t cols, uint64_t simulation_seed, topology_t grid_topology = bounded)
+    {
+        resize(rows, cols, simulation_seed, grid_topology);
+        run = next_run();
+    }
+
+    // Clears the grid to the given size without starting a new run
+    void resize(uint32_t rows, uint32_t cols, uint64_t simulation_seed, topology_t grid_topology = bounded)
+    {
+        current.reset(rows, cols);
+        next.reset(rows, cols);
+        occupancy.reset(rows, cols, grid_topology);
+        link_neighbors(grid_topology);
+        intent.assign(current.size(), 0);
+        changed_tick.assign(current.size(), 0);
+        changed_cells = 0;
+        population = ~0ULL;
+        sparse = false;
+        live.clear();
+        next_vacant.assign(tile_count(), 0);
+        skipped_tiles = 0;
+        plant_tiles = 0;
+        tick = 0;
+        seed = simulation_seed;
+        origin_row = 0;
+        origin_col = 0;
+        world_cols = cols;
+    }
+
+    // Fills the neighbour tables. Past a bounded edge, rows point at the
+    // ghost row and columns at the ghost column.
+    void link_neighbors(topology_t grid_topology)
+    {
+        topology = grid_topology;
+        bool wraps = topology == toroidal;
+        uint32_t rows = current.rows;
+        uint32_t cols = current.cols;
+        neighbor_rows.resize((size_t)rows * 4);
+        neighbor_cols.resize((size_t)cols * 4);
+        for (uint32_t i = 0; i < rows; i++)
+        {
+            neighbor_rows[i * 4 + up] = current.index(i > 0 ? i - 1 : wraps ? rows - 1 : rows, 0);
+            neighbor_rows[i * 4 + down] = current.index(i + 1 < rows ? i + 1 : wraps ? 0 : rows, 0);
+            neighbor_rows[i * 4 + left] = neighbor_rows[i * 4 + right] = current.index(i, 0);
+        }
+        for (uint32_t j = 0; j < cols; j++)
+        {
+            neighbor_cols[j * 4 + up] = neighbor_cols[j * 4 + down] = j;
+            neighbor_cols[j * 4 + left] = j > 0 ? j - 1 : wraps ? cols - 1 : cols;
+            neighbor_cols[j * 4 + right] = j + 1 < cols ? j + 1 : wraps ? 0 : cols;
+        }
+        // Rounded up, which makes row() exact for every index of the grid
+        stride_inverse = ~0ULL / current.stride + 1;
+    }
+
+    // The row of cell idx
+    size_t row(size_t idx) const
+    {
+        return (size_t)((unsigned __int128)idx * stride_inverse >> 64);
+    }
+
+    bool changed_at(size_t idx, uint64_t t) const
+    {
+        return changed_tick[idx] == (uint32_t)t;
+    }
+
+    static uint64_t random_seed()
+    {
+        std::random_device rd;
+        return (uint64_t)rd() << 32 | rd();
+    }
+
+    // Places the initial entities at distinct random cells: entity n lives
+    // on cell perm(n) of a permutation of the cells keyed by the stream
+    // reserved for placement (the one of tick ~0). Plants take the first
+    // numbers, then herbivores, then carnivores. No entity needs to look at
+    // another, so placement never retries and runs on the pool. Sparse
+    // populations scatter each entity to its cell in O(entities); dense ones
+    // sweep the cells in order and look up which entity, if any, each one
+    // holds, trading random writes for sequential ones. Both give the same
+    // grid. Expects a freshly reset (empty) grid.
+    void populate(thread_pool_t &pool, uint32_t plants, uint32_t herbivores, uint32_t carnivores, unsigned concurrency = ~0u)
+    {
+        uint64_t cell_count = (uint64_t)current.rows * current.cols;
+        index_permutation_t cells(tick_key(seed, ~0ULL), cell_count);
+        uint64_t herbivores_begin = plants;
+        uint64_t carnivores_begin = herbivores_begin + herbivores;
+        uint64_t total = carnivores_begin + carnivores;
+        auto place = [&](size_t idx, uint64_t n)
+        {
+            entity_type_t type = n < herbivores_begin ? plant : n < carnivores_begin ? herbivore : carnivore;
+            current.type[idx] = type;
+            current.energy[idx] = type == plant ? 0 : INITIAL_ENERGY;
+            current.age[idx] = 0;
+        };
+
+        if (total * PLACEMENT_SWEEP_RATIO < cell_count)
+        {
+            pool.parallel_for((uint32_t)total, PLACEMENT_GRAIN, [&](uint32_t begin, uint32_t end)
+                              {
+                for (uint64_t n = begin; n < end; n++)
+                {
+                    uint64_t cell = cells(n);
+                    place(current.index((uint32_t)(cell / current.cols), (uint32_t)(cell % current.cols)), n);
+                } }, concurrency);
+            return;
+        }
+        pool.parallel_for(current.rows, TILE_ROWS, [&](uint32_t row_begin, uint32_t row_end)
+                          {
+            for (uint32_t i = row_begin; i < row_end; i++)
+            {
+                for (uint32_t j = 0; j < current.cols; j++)
+                {
+                    uint64_t n = cells.inverse((uint64_t)i * current.cols + j);
+                    if (n < total)
+                    {
+                        place(current.index(i, j), n);
+                    }
+                }
+            } }, concurrency);
+    }
+
+    // Fills each cell on its own with a carnivore, herbivore or plant with
+    // the given probabilities (indexed by entity_type_t), using the cell's
+    // stream in the placement tick. With patch_scale set, the plant
+    // probability follows a noise field with features of about patch_scale
+    // cells: dense patches and bare ground with roughly the same mean.
+    void populate_densities(thread_pool_t &pool, const double density[4], double patch_scale, unsigned concurrency = ~0u)
+    {
+        uint64_t key = tick_key(seed, ~0ULL);
+        pool.parallel_for(current.rows, TILE_ROWS, [&](uint32_t row_begin, uint32_t row_end)
+                          {
+            for (uint32_t i = row_begin; i < row_end; i++)
+            {
+                for (uint32_t j = 0; j < current.cols; j++)
+                {
+                    double plants = density[plant];
+                    if (patch_scale > 0)
+                    {
+                        plants *= 2 * patch_level(key, i / patch_scale, j / patch_scale);
+                    }
+                    double draw = cell_rng(key, i, j).uniform();
+                    entity_type_t type = empty;
+                    if (draw < density[carnivore])
+                    {
+                        type = carnivore;
+                    }
+                    else if (draw < density[carnivore] + density[herbivore])
+                    {
+                        type = herbivore;
+                    }
+                    else if (draw < density[carnivore] + density[herbivore] + plants)
+                    {
+                        type = plant;
+                    }
+                    size_t idx = current.index(i, j);
+                    current.type[idx] = type;
+                    current.energy[idx] = type == plant || type == empty ? 0 : INITIAL_ENERGY;
+                    current.age[idx] = 0;
+                }
+            } }, concurrency);
+    }
+
+    // Copies a row-major map of the whole grid, as entity types
+    void populate_map(thread_pool_t &pool, const std::vector<entity_type_t> &map, unsigned concurrency = ~0u)
+    {
+        pool.parallel_for(current.rows, TILE_ROWS, [&](uint32_t row_begin, uint32_t row_end)
+                          {
+            for (uint32_t i = row_begin; i < row_end; i++)
+            {
+                for (uint32_t j = 0; j < current.cols; j++)
+                {
+                    entity_type_t type = map[(size_t)i * current.cols + j];
+                    size_t idx = current.index(i, j);
+                    current.type[idx] = type;
+                    current.energy[idx] = type == plant || type == empty ? 0 : INITIAL_ENERGY;
+                    current.age[idx] = 0;
+                }
+            } }, concurrency);
+    }
+
+    // Three octaves of value noise, stretched around the middle so the
+    // field has clear patches, clamped to [0, 1] with a mean near 1/2
+    static double patch_level(uint64_t key, double x, double y)
+    {
+        double noise = (value_noise(key, x, y) + 0.5 * value_noise(key + 1, 2 * x, 2 * y) + 0.25 * value_noise(key + 2, 4 * x, 4 * y)) / 1.75;
+        return std::min(1.0, std::max(0.0, (noise - 0.5) * 3 + 0.5));
+    }
+
+    // The neighbour of cell idx in direction dir. Off a bounded grid's edge
+    // it is a ghost cell, which is always empty and never has an intent.
+    size_t neighbor(size_t idx, direction_t dir) const
+    {
+        size_t i = row(idx);
+        return neighbor_rows[i * 4 + dir] + neighbor_cols[(idx - i * current.stride) * 4 + dir];
+    }
+
+    // Picks a random direction out of a 4-bit mask of directions, such as
+    // the neighbours holding some type
+    static bool random_neighbor(cell_rng_t &rng, uint8_t candidates, direction_t &out)
+    {
+        uint32_t count = (uint32_t)__builtin_popcount(candidates);
+        if (count == 0)
+        {
+            return false;
+        }
+        for (uint32_t k = rng.below(count); k > 0; k--)
+        {
+            candidates &= candidates - 1;
+        }
+        out = (direction_t)__builtin_ctz(candidates);
+        return true;
+    }
+
+    // Stream keyed by the cell's row-major position in the world,
+    // independent of stride
+    cell_rng_t cell_rng(uint64_t key, uint32_t i, uint32_t j) const
+    {
+        return cell_rng_t(key, (origin_row + i) * world_cols + origin_col + j);
+    }
+
+    // Plans the entity at (i, j), bit b of its row word; masks holds the
+    // word's neighbour masks for each type with an occupancy plane
+    void plan_cell(uint64_t key, uint32_t i, uint32_t j, const uint64_t masks[bitboard_t::PLANES][4], uint32_t b)
+    {
+        size_t idx = current.index(i, j);
+        entity_type_t type = current.type[idx];
+        intent[idx] = make_intent(stay, up);
+        if ((uint32_t)current.age[idx] >= maximum_age(type) ||
+            (type != plant && current.energy[idx] <= 0))
+        {
+            intent[idx] = make_intent(die, up);
+            return;
+        }
+
+        cell_rng_t rng = cell_rng(key, i, j);
+        direction_t dir;
+        if (type == plant)
+        {
+            if (rng.chance(PLANT_REPRODUCTION_PROBABILITY) && random_neighbor(rng, bitboard_t::directions(masks[empty], b), dir))
+            {
+                intent[idx] = make_intent(spawn, dir);
+            }
+            return;
+        }
+
+        entity_type_t prey = type == herbivore ? plant : herbivore;
+        double eat_probability = type == herbivore ? HERBIVORE_EAT_PROBABILITY : CARNIVORE_EAT_PROBABILITY;
+        double move_probability = type == herbivore ? HERBIVORE_MOVE_PROBABILITY : CARNIVORE_MOVE_PROBABILITY;
+        if ((uint32_t)current.energy[idx] > THRESHOLD_ENERGY_FOR_REPRODUCTION && rng.chance(reproduction_probability(type)))
+        {
+            if (random_neighbor(rng, bitboard_t::directions(masks[empty], b), dir))
+            {
+                intent[idx] = make_intent(spawn, dir);
+            }
+        }
+        else if (random_neighbor(rng, bitboard_t::directions(masks[prey], b), dir) && rng.chance(eat_probability))
+        {
+            intent[idx] = make_intent(eat, dir);
+        }
+        else if (rng.chance(move_probability) && random_neighbor(rng, bitboard_t::directions(masks[empty], b), dir))
+        {
+            intent[idx] = make_intent(move, dir);
+        }
+    }
+
+    // True when the neighbour n aims an intent with the given action at the
+    // cell lying in direction d ^ 1 from n
+    bool aims_at(size_t n, action_t action, direction_t d) const
+    {
+        return intent_action(intent[n]) == action && intent_direction(intent[n]) == (d ^ 1);
+    }
+
+    // Returns the predator whose eat claim on the prey at idx wins
+    bool eat_winner(size_t idx, size_t &source) const
+    {
+        // The tie-breaking order of the conflict rules
+        static const direction_t order[4] = {up, left, right, down};
+        entity_type_t predator = current.type[idx] == plant ? herbivore : carnivore;
+        for (direction_t d : order)
+        {
+            size_t n = neighbor(idx, d);
+            if (current.type[n] == predator && aims_at(n, eat, d) && !eaten(n))
+            {
+                source = n;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool eaten(size_t idx) const
+    {
+        if (current.type[idx] != plant && current.type[idx] != herbivore)
+        {
+            return false;
+        }
+        size_t source = 0;
+        return eat_winner(idx, source);
+    }
+
+    // Returns the neighbour whose spawn or move claim on the empty cell idx
+    // wins
+    bool claim_winner(size_t idx, size_t &source) const
+    {
+        static const direction_t order[4] = {up, left, right, down};
+        entity_type_t best = empty;
+        for (direction_t d : order)
+        {
+            size_t n = neighbor(idx, d);
+            if (current.type[n] > best &&
+                (aims_at(n, spawn, d) || aims_at(n, move, d)) && !eaten(n))
+            {
+                best = current.type[n];
+                source = n;
+            }
+        }
+        return best != empty;
+    }
+
+    // The neighbour that intent of idx is aimed at
+    size_t target(size_t idx) const
+    {
+        return neighbor(idx, intent_direction(intent[idx]));
+    }
+
+    // The state of cell idx in the next generation, from the current one and
+    // the intents aimed at it
+    cell_state_t resolve_cell(size_t idx) const
+    {
+        entity_type_t type = current.type[idx];
+        size_t source = 0;
+        if (type == empty)
+        {
+            if (!claim_winner(idx, source))
+            {
+                return {empty, 0, 0};
+            }
+            if (intent_action(intent[source]) == spawn)
+            {
+                entity_type_t child = current.type[source];
+                return {child, (int16_t)(child == plant ? 0 : INITIAL_ENERGY), 0};
+            }
+            return {current.type[source], (int16_t)(current.energy[source] - MOVE_ENERGY_COST), (int16_t)(current.age[source] + 1)};
+        }
+
+        action_t action = intent_action(intent[idx]);
+        if (action == die || eaten(idx))
+        {
+            return {empty, 0, 0};
+        }
+
+        int32_t energy = current.energy[idx];
+        if (action == move && claim_winner(target(idx), source) && source == idx)
+        {
+            return {empty, 0, 0};
+        }
+        if (action == eat && eat_winner(target(idx), source) && source == idx)
+        {
+            energy += type == herbivore ? HERBIVORE_EAT_ENERGY_GAIN : CARNIVORE_EAT_ENERGY_GAIN;
+            energy = std::min<int32_t>(energy, MAXIMUM_ENERGY);
+        }
+        if (action == spawn && type != plant && claim_winner(target(idx), source) && source == idx)
+        {
+            energy -= REPRODUCTION_ENERGY_COST;
+        }
+        return {type, (int16_t)energy, (int16_t)(current.age[idx] + 1)};
+    }
+
+    uint32_t tile_count() const
+    {
+        return ((current.rows + TILE_ROWS - 1) / TILE_ROWS) * ((current.cols + TILE_COLS - 1) / TILE_COLS);
+    }
+
+    tile_t tile(uint32_t t) const
+    {
+        uint32_t tiles_per_row = (current.cols + TILE_COLS - 1) / TILE_COLS;
+        uint32_t row_begin = t / tiles_per_row * TILE_ROWS;
+        uint32_t col_begin = t % tiles_per_row * TILE_COLS;
+        return {row_begin, std::min(current.rows, row_begin + TILE_ROWS),
+                col_begin, std::min(current.cols, col_begin + TILE_COLS)};
+    }
+
+    // Classifies a tile from the occupancy planes of the current generation:
+    // whether it holds no entity, and how the dense engine may treat it
+    tile_mode_t classify_tile(const tile_t &t, uint32_t index, bool &vacant) const
+    {
+        uint32_t word_begin = t.col_begin / 64;
+        uint32_t word_end = (t.col_end + 63) / 64;
+        uint64_t occupied = 0;
+        uint64_t not_plant = 0;
+        for (uint32_t i = t.row_begin; i < t.row_end; i++)
+        {
+            for (uint32_t w = word_begin; w < word_end; w++)
+            {
+                occupied |= occupancy.occupied(i, w);
+                not_plant |= occupancy.valid(w) & ~occupancy.row(plant, i)[w];
+            }
+        }
+
+        // The halo: the cells just above, below, left and right of the tile,
+        // wrapping around on a toroidal grid
+        uint64_t halo_occupied = 0;
+        uint64_t halo_herbivores = 0;
+        auto halo = [&](uint32_t i, uint32_t w, uint64_t bits)
+        {
+            halo_occupied |= occupancy.occupied(i, w) & bits;
+            halo_herbivores |= occupancy.row(herbivore, i)[w] & bits;
+        };
+        uint32_t above = occupancy.up_row[t.row_begin];
+        uint32_t below = occupancy.down_row[t.row_end - 1];
+        for (uint32_t w = word_begin; w < word_end; w++)
+        {
+            if (above != current.rows)
+            {
+                halo(above, w, ~0ULL);
+            }
+            if (below != current.rows)
+            {
+                halo(below, w, ~0ULL);
+            }
+        }
+        const bitboard_t::word_link_t &first = occupancy.links[word_begin];
+        const bitboard_t::word_link_t &last = occupancy.links[word_end - 1];
+        for (uint32_t i = t.row_begin; i < t.row_end; i++)
+        {
+            if (first.left_mask != 0)
+            {
+                halo(i, first.left_word, 1ULL << first.left_bit);
+            }
+            if (last.right_mask != 0)
+            {
+                halo(i, last.right_word, 1ULL << last.right_bit);
+            }
+        }
+
+        vacant = occupied == 0;
+        if (vacant && halo_occupied == 0 && next_vacant[index])
+        {
+            return tile_quiet;
+        }
+        if (!vacant && not_plant == 0 && halo_herbivores == 0)
+        {
+            return tile_plants;
+        }
+        return tile_full;
+    }
+
+    // Plans a tile a row word at a time: the neighbour masks of all 64 cells
+    // of a word come from a few shifts of the occupancy planes, and only the
+    // occupied cells are visited. Tiles span whole words (TILE_COLS is a
+    // multiple of 64). In a tile of plants only the plants that could spread
+    // out of it need an intent; the others can only age or die, which the
+    // resolve pass works out on its own.
+    void plan_tile(uint64_t key, const tile_t &t, tile_mode_t mode)
+    {
+        if (mode == tile_quiet)
+        {
+            return;
+        }
+        for (uint32_t i = t.row_begin; i < t.row_end; i++)
+        {
+            std::fill(intent.begin() + current.index(i, t.col_begin), intent.begin() + current.index(i, t.col_end), make_intent(stay, up));
+            for (uint32_t w = t.col_begin / 64; w * 64 < t.col_end; w++)
+            {
+                uint64_t occupied = occupancy.occupied(i, w);
+                if (occupied == 0)
+                {
+                    continue;
+                }
+                uint64_t masks[bitboard_t::PLANES][4];
+                for (uint32_t type = 0; type < bitboard_t::PLANES; type++)
+                {
+                    occupancy.neighbors(type, i, w, masks[type]);
+                }
+                if (mode == tile_plants)
+                {
+                    occupied &= masks[empty][up] | masks[empty][down] | masks[empty][left] | masks[empty][right];
+                }
+                for (; occupied != 0; occupied &= occupied - 1)
+                {
+                    uint32_t b = (uint32_t)__builtin_ctzll(occupied);
+                    plan_cell(key, i, w * 64 + b, masks, b);
+                }
+            }
+        }
+    }
+
+    // Resolves a tile into the next generation and returns how many of its
+    // cells changed and how many hold an entity afterwards
+    tile_stats_t resolve_tile(const tile_t &t)
+    {
+        tile_stats_t stats{0, 0};
+        uint32_t stamp = (uint32_t)(tick + 1);
+        for (uint32_t i = t.row_begin; i < t.row_end; i++)
+        {
+            for (uint32_t j = t.col_begin; j < t.col_end; j++)
+            {
+                size_t idx = current.index(i, j);
+                cell_state_t cell = resolve_cell(idx);
+                next.type[idx] = cell.type;
+                next.energy[idx] = cell.energy;
+                next.age[idx] = cell.age;
+                if (cell.type != current.type[idx] || cell.energy != current.energy[idx] || cell.age != current.age[idx])
+                {
+                    changed_tick[idx] = stamp;
+                    stats.changes++;
+                }
+                stats.population += cell.type != empty;
+            }
+        }
+        return stats;
+    }
+
+    // Resolves a tile of plants that nothing can eat or spread into: each
+    // plant ages, or dies once it reaches its maximum age
+    tile_stats_t resolve_plant_tile(const tile_t &t)
+    {
+        tile_stats_t stats{0, 0};
+        uint32_t stamp = (uint32_t)(tick + 1);
+        int16_t lifetime = (int16_t)maximum_age(plant);
+        for (uint32_t i = t.row_begin; i < t.row_end; i++)
+        {
+            for (size_t idx = current.index(i, t.col_begin); idx < current.index(i, t.col_end); idx++)
+            {
+                bool dies = current.age[idx] >= lifetime;
+                next.type[idx] = dies ? empty : plant;
+                next.energy[idx] = dies ? 0 : current.energy[idx];
+                next.age[idx] = dies ? 0 : current.age[idx] + 1;
+                changed_tick[idx] = stamp;
+                stats.population += !dies;
+            }
+            stats.changes += t.col_end - t.col_begin;
+        }
+        return stats;
+    }
+
+    // Advances one tick, with the dense engine while the grid is crowded and
+    // the sparse one while it is mostly empty. Both give the same result.
+    // At most concurrency threads work on this simulation.
+    void step(thread_pool_t &pool, unsigned concurrency = ~0u)
+    {
+        uint64_t cells = (uint64_t)current.rows * current.cols;
+        if (sparse ? population > cells / SPARSE_LEAVE_RATIO : population < cells / SPARSE_ENTER_RATIO)
+        {
+            sparse = !sparse;
+            if (sparse)
+            {
+                enter_sparse(pool, concurrency);
+            }
+        }
+        if (sparse)
+        {
+            step_sparse(pool, concurrency);
+        }
+        else
+        {
+            step_dense(pool, concurrency);
+        }
+        tick++;
+    }
+
+    // Processes every cell, tile by tile on the pool's workers. Tiles only
+    // read their halo (the cells around their border) and only write their
+    // own cells, so adjacent tiles can run at the same time; the one
+    // synchronization point is the barrier between the two passes. Random
+    // draws come from per-cell counter streams, so no RNG state is shared.
+    //
+    // Tiles that cannot change are skipped: an empty tile with an empty halo
+    // stays empty, and needs no work once the other buffer holds it empty
+    // too. A tile of plants out of reach of herbivores only ages.
+    void step_dense(thread_pool_t &pool, unsigned concurrency)
+    {
+        uint32_t tiles = tile_count();
+        uint64_t key = tick_key(seed, tick);
+        tile_stats.assign(tiles, tile_stats_t{0, 0});
+        tile_modes.resize(tiles);
+        tile_vacant.resize(tiles);
+
+        pool.parallel_for(current.rows, TILE_ROWS, [&](uint32_t begin, uint32_t end)
+                          { occupancy.build(current, begin, end); }, concurrency);
+        pool.parallel_for(tiles, 1, [&](uint32_t begin, uint32_t end)
+                          {
+            for (uint32_t t = begin; t < end; t++)
+            {
+                bool vacant;
+                tile_modes[t] = classify_tile(tile(t), t, vacant);
+                tile_vacant[t] = vacant;
+                plan_tile(key, tile(t), tile_modes[t]);
+            } }, concurrency);
+        pool.parallel_for(tiles, 1, [&](uint32_t begin, uint32_t end)
+                          {
+            for (uint32_t t = begin; t < end; t++)
+            {
+                if (tile_modes[t] == tile_plants)
+                {
+                    tile_stats[t] = resolve_plant_tile(tile(t));
+                }
+                else if (tile_modes[t] == tile_full)
+                {
+                    tile_stats[t] = resolve_tile(tile(t));
+                }
+            } }, concurrency);
+        std::swap(current, next);
+        // The generation just stepped from is now the other buffer
+        next_vacant.swap(tile_vacant);
+
+        changed_cells = 0;
+        population = 0;
+        skipped_tiles = 0;
+        plant_tiles = 0;
+        for (uint32_t t = 0; t < tiles; t++)
+        {
+            changed_cells += tile_stats[t].changes;
+            population += tile_stats[t].population;
+            skipped_tiles += tile_modes[t] == tile_quiet;
+            plant_tiles += tile_modes[t] == tile_plants;
+        }
+    }
+
+    // Sets up the sparse engine's state from the current generation: the
+    // occupancy planes, the live list, and intents that are all "stay"
+    void enter_sparse(thread_pool_t &pool, unsigned concurrency)
+    {
+        // The sparse engine leaves the other buffer behind
+        next_vacant.assign(tile_count(), 0);
+        skipped_tiles = 0;
+        plant_tiles = 0;
+        pool.parallel_for(current.rows, TILE_ROWS, [&](uint32_t begin, uint32_t end)
+                          {
+            occupancy.build(current, begin, end);
+            std::fill(intent.begin() + current.index(begin, 0), intent.begin() + current.index(end - 1, 0) + current.stride, make_intent(stay, up)); }, concurrency);
+        live.clear();
+        for (uint32_t i = 0; i < current.rows; i++)
+        {
+            for (uint32_t w = 0; w < occupancy.words; w++)
+            {
+                uint64_t occupied = occupancy.occupied(i, w);
+                for (; occupied != 0; occupied &= occupied - 1)
+                {
+                    live.push_back(current.index(i, w * 64 + (uint32_t)__builtin_ctzll(occupied)));
+                }
+            }
+        }
+    }
+
+    // Processes only the live entities and the empty cells they claim, in
+    // chunks of the live list on the pool's workers. Each chunk records the
+    // new state of its cells in a change list; once every chunk is done the
+    // changes are applied in place, with the occupancy planes and the live
+    // list kept up to date, so a tick costs time in proportion to the
+    // population rather than to the grid.
+    void step_sparse(thread_pool_t &pool, unsigned concurrency)
+    {
+        uint64_t key = tick_key(seed, tick);
+        uint32_t count = (uint32_t)live.size();
+        uint32_t chunks = (count + SPARSE_GRAIN - 1) / SPARSE_GRAIN;
+
+        pool.parallel_for(count, SPARSE_GRAIN, [&](uint32_t begin, uint32_t end)
+                          {
+            uint64_t masks[bitboard_t::PLANES][4];
+            for (uint32_t k = begin; k < end; k++)
+            {
+                uint32_t i = (uint32_t)(live[k] / current.stride);
+                uint32_t j = (uint32_t)(live[k] % current.stride);
+                for (uint32_t type = 0; type < bitboard_t::PLANES; type++)
+                {
+                    occupancy.neighbors(type, i, j / 64, masks[type]);
+                }
+                plan_cell(key, i, j, masks, j % 64);
+            } }, concurrency);
+
+        chunk_changes.resize(chunks);
+        pool.parallel_for(chunks, 1, [&](uint32_t begin, uint32_t end)
+                          {
+            for (uint32_t c = begin; c < end; c++)
+            {
+                std::vector<cell_change_t> &changes = chunk_changes[c];
+                changes.clear();
+                for (uint32_t k = c * SPARSE_GRAIN; k < std::min(count, (c + 1) * SPARSE_GRAIN); k++)
+                {
+                    size_t idx = live[k];
+                    changes.push_back({idx, resolve_cell(idx)});
+                    // An empty cell changes only when a claim on it wins, and
+                    // the winner records it
+                    action_t action = intent_action(intent[idx]);
+                    size_t source = 0;
+                    if ((action == move || action == spawn) && claim_winner(target(idx), source) && source == idx)
+                    {
+                        changes.push_back({target(idx), resolve_cell(target(idx))});
+                    }
+                }
+            } }, concurrency);
+
+        for (size_t idx : live)
+        {
+            intent[idx] = make_intent(stay, up);
+        }
+        live.clear();
+        changed_cells = 0;
+        uint32_t stamp = (uint32_t)(tick + 1);
+        for (uint32_t c = 0; c < chunks; c++)
+        {
+            for (const cell_change_t &change : chunk_changes[c])
+            {
+                size_t idx = change.idx;
+                const cell_state_t &cell = change.state;
+                if (cell.type != current.type[idx] || cell.energy != current.energy[idx] || cell.age != current.age[idx])
+                {
+                    changed_tick[idx] = stamp;
+                    changed_cells++;
+                }
+                if (cell.type != current.type[idx])
+                {
+                    occupancy.set((uint32_t)(idx / current.stride), (uint32_t)(idx % current.stride), current.type[idx], cell.type);
+                }
+                current.type[idx] = cell.type;
+                current.energy[idx] = cell.energy;
+                current.age[idx] = cell.age;
+                if (cell.type != empty)
+                {
+                    live.push_back(idx);
+                }
+            }
+        }
+        population = live.size();
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "json.hpp"
+#include <cstdint>
+#include <vector>
+
+// Type definitions
+enum entity_type_t : uint8_t
+{
+    empty,
+    plant,
+    herbivore,
+    carnivore
+};
+
+// How the grid's edges behave: bounded grids end there, toroidal ones wrap
+// around to the opposite edge
+enum topology_t : uint8_t
+{
+    bounded,
+    toroidal
+};
+
+struct entity_t
+{
+    entity_type_t type;
+    int32_t energy;
+    int32_t age;
+};
+
+// Row stride is rounded up so every row starts on a SIMD-friendly boundary
+static const uint32_t GRID_ROW_ALIGNMENT = 16;
+
+// Struct-of-arrays grid: one contiguous row-major array per field, so a scan
+// over a single field touches memory sequentially. Every row has at least one
+// padding column past the last one, and one padding row follows the last
+// row: a ghost border of cells that are always empty, which a bounded grid
+// uses as the neighbour of the cells on its edges.
+struct grid_t
+{
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint32_t stride = 0;
+    std::vector<entity_type_t> type;
+    std::vector<int16_t> energy;
+    std::vector<int16_t> age;
+
+    void reset(uint32_t num_rows, uint32_t num_cols)
+    {
+        rows = num_rows;
+        cols = num_cols;
+        stride = (num_cols + GRID_ROW_ALIGNMENT) / GRID_ROW_ALIGNMENT * GRID_ROW_ALIGNMENT;
+        size_t cells = ((size_t)rows + 1) * stride;
+        type.assign(cells, empty);
+        energy.assign(cells, 0);
+        age.assign(cells, 0);
+    }
+
+    size_t index(uint32_t i, uint32_t j) const
+    {
+        return (size_t)i * stride + j;
+    }
+
+    size_t size() const
+    {
+        return type.size();
+    }
+
+    // Memory held by the three field arrays
+    size_t bytes() const
+    {
+        return size() * (sizeof(entity_type_t) + 2 * sizeof(int16_t));
+    }
+
+    // Number of entities of each type, indexed by entity_type_t
+    std::vector<uint64_t> census() const
+    {
+        std::vector<uint64_t> counts(4, 0);
+        for (uint32_t i = 0; i < rows; i++)
+        {
+            const entity_type_t *row = &type[index(i, 0)];
+            for (uint32_t j = 0; j < cols; j++)
+            {
+                counts[row[j]]++;
+            }
+        }
+        return counts;
+    }
+
+    // FNV-1a over the visible cells, used to compare runs
+    uint64_t checksum() const
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (uint32_t i = 0; i < rows; i++)
+        {
+            for (uint32_t j = 0; j < cols; j++)
+            {
+                size_t idx = index(i, j);
+                uint64_t cell = (uint64_t)type[idx] | (uint64_t)(uint16_t)energy[idx] << 8 | (uint64_t)(uint16_t)age[idx] << 24;
+                hash = (hash ^ cell) * 0x100000001b3ULL;
+            }
+        }
+        return hash;
+    }
+
+    entity_t at(uint32_t i, uint32_t j) const
+    {
+        size_t idx = index(i, j);
+        return {type[idx], energy[idx], age[idx]};
+    }
+};
+
+// Auxiliary code to convert the entity_type_t enum to a string
+NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
+                                                {empty, " "},
+                                                {plant, "P"},
+                                                {herbivore, "H"},
+                                                {carnivore, "C"},
+                                            })
+
+// Auxiliary code to convert the entity_t struct and the grid to JSON
+namespace nlohmann
+{
+    inline void to_json(nlohmann::json &j, const entity_t &e)
+    {
+        j = nlohmann::json{{"type", e.type}, {"energy", e.energy}, {"age", e.age}};
+    }
+
+    inline void to_json(nlohmann::json &j, const grid_t &g)
+    {
+        j = nlohmann::json::array();
+        for (uint32_t r = 0; r < g.rows; r++)
+        {
+            nlohmann::json row = nlohmann::json::array();
+            for (uint32_t c = 0; c < g.cols; c++)
+            {
+                row.push_back(g.at(r, c));
+            }
+            j.push_back(std::move(row));
+        }
+    }
+}
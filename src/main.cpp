@@ -3,434 +3,440 @@
 
 #include "crow_all.h"
 #include "json.hpp"
-#include <random>
-#include <thread>
-#include <vector>
+#include "driver.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
 #include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
-static const uint32_t NUM_ROWS = 15;
-
-// Constants
-const uint32_t PLANT_MAXIMUM_AGE = 10;
-const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
-const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
-const uint32_t MAXIMUM_ENERGY = 200;
-const uint32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
-
-// Probabilities
-const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
-const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
-const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
-const double HERBIVORE_MOVE_PROBABILITY = 0.7;
-const double HERBIVORE_EAT_PROBABILITY = 0.9;
-const double CARNIVORE_MOVE_PROBABILITY = 0.5;
-const double CARNIVORE_EAT_PROBABILITY = 1.0;
-
-// Type definitions
-enum entity_type_t
-{
-    empty,
-    plant,
-    herbivore,
-    carnivore
-};
-
-struct pos_t
-{
-    uint32_t i;
-    uint32_t j;
-};
-
-struct entity_t
+// Grid dimensions, chosen per simulation in /start-simulation
+static const uint32_t DEFAULT_NUM_ROWS = 15;
+static const uint32_t MAXIMUM_GRID_DIMENSION = 8192;
+// Larger worlds are kept in chunks, populated from exact counts only, and
+// read through regions of at most MAXIMUM_GRID_DIMENSION square, by default
+// the top-left DEFAULT_REGION_DIMENSION square.
+static const uint32_t MAXIMUM_CHUNKED_DIMENSION = 1 << 20;
+// Entities scattered over a large world mostly land in chunks of their own,
+// and every such chunk costs about 40 KB (20 KB of cells, kept twice across
+// a tick) and 0.15 ms of one core per tick to step its 74x74 window. At this
+// cap a fully scattered world holds about 650 MB and takes over 2 s per tick
+// on one core.
+static const uint32_t MAXIMUM_CHUNKED_ENTITIES = 1 << 14;
+static const uint32_t DEFAULT_REGION_DIMENSION = 256;
+static const uint32_t MAXIMUM_WORKERS = 256;
+static const uint32_t MAXIMUM_ADVANCE_STEPS = 1000000;
+static const double MAXIMUM_STREAM_RATE = 1000.0;
+
+// Hosts every simulation session and steps them on a shared worker pool
+static simulation_driver_t driver;
+
+// A WebSocket client of /ws. At most one frame is in flight per client: the
+// next one is only sent after the client acknowledges the last, as a delta
+// covering every tick it missed, so slow clients drop intermediate frames.
+struct subscriber_t
 {
-    entity_type_t type;
-    int32_t energy;
-    int32_t age;
-    std::mutex* m;
+    session_id_t session = DEFAULT_SESSION;
+    bool has_frame = false;
+    bool in_flight = false;
+    uint32_t run = 0;
+    uint64_t acked_tick = 0;
+    // Tells this client apart from a later one at the same address
+    uint64_t serial = 0;
 };
 
-// Auxiliary code to convert the entity_type_t enum to a string
-NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
-                                                {empty, " "},
-                                                {plant, "P"},
-                                                {herbivore, "H"},
-                                                {carnivore, "C"},
-                                            })
+static counted_mutex_t subscribers_mutex;
+static std::map<crow::websocket::connection *, subscriber_t> subscribers;
+static uint64_t next_subscriber_serial = 0;
+// Sessions running on a nonzero rate set through /ws
+static std::set<session_id_t> streamed_sessions;
 
-// Auxiliary code to convert the entity_t struct to a JSON object
-namespace nlohmann
+// Called when a client stops following a session: pauses it if its rate was
+// set through /ws and no other client follows it, so that sessions do not
+// keep ticking for nobody. Must be called with subscribers_mutex held.
+void release_rate(session_id_t id)
 {
-    void to_json(nlohmann::json &j, const entity_t &e)
+    if (streamed_sessions.count(id) == 0)
     {
-        j = nlohmann::json{{"type", e.type}, {"energy", e.energy}, {"age", e.age}};
+        return;
+    }
+    for (auto &it : subscribers)
+    {
+        if (it.second.session == id)
+        {
+            return;
+        }
+    }
+    streamed_sessions.erase(id);
+    session_ptr session = driver.find(id);
+    if (session)
+    {
+        driver.set_rate(session, 0);
     }
 }
 
-// Grid that contains the entities
-static std::vector<std::vector<entity_t>> entity_grid;
-
-bool random_action(double probability)
+// Sends the snapshot to a subscriber unless it has a frame in flight or
+// already holds this one. Chunked worlds are not streamed. Must be called
+// with subscribers_mutex held.
+void push_frame(crow::websocket::connection &conn, subscriber_t &subscriber, const snapshot_t &snapshot)
 {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(0.0, 1.0);
-    return dis(gen) < probability;
+    if (subscriber.in_flight || snapshot.chunked)
+    {
+        return;
+    }
+    if (subscriber.has_frame && subscriber.run == snapshot.run && subscriber.acked_tick == snapshot.tick)
+    {
+        return;
+    }
+    // Crow deletes a connection on its I/O thread right after closing it, so
+    // a frame is only sent from that thread, once it has made sure the
+    // client is still there. The connection is alive here: it is only
+    // deleted after onclose has taken it out of subscribers.
+    std::string frame = encode_frame(snapshot, subscriber.has_frame, subscriber.run, subscriber.acked_tick);
+    static_cast<crow::websocket::Connection<crow::SocketAdaptor> &>(conn).post([&conn, serial = subscriber.serial, frame = std::move(frame)]()
+                                                                               {
+        std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+        auto it = subscribers.find(&conn);
+        if (it != subscribers.end() && it->second.serial == serial)
+        {
+            conn.send_binary(frame);
+        } });
+    subscriber.in_flight = true;
 }
 
-uint32_t i, j;
-std::vector<pos_t> valid_pos, occupied_pos;
-pos_t pos_aleatoria, pos, current_pos;
-
-std::vector<std::thread> threads;
-
-//pos_t eat_plant = check_plants(pos, occupied_pos);
-// pos_t eat_herb = check_herbivores(pos, occupied_pos);
-
-bool check_availability(pos_t current_pos, std::vector<pos_t> occupied_pos)
+// Called on a driver worker after every publish of a session
+void publish_frames(session_id_t session, const snapshot_ptr &snapshot)
 {
-    for (auto &it : occupied_pos)
+    std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+    for (auto &it : subscribers)
     {
-        if (it.i == current_pos.i && it.j == current_pos.j)
+        if (it.second.session == session)
         {
-            return false;
+            push_frame(*it.first, it.second, *snapshot);
         }
     }
-    return true;
 }
 
-void lock(pos_t pos){
-    entity_grid[pos.i][pos.j].m-> lock();  
-    if (pos.i + 1 < NUM_ROWS)
+// Sends the latest snapshot of a session to a subscriber still following
+// it, without waiting for a spilled session to be restored
+void catch_up(crow::websocket::connection &conn, const session_ptr &session)
+{
+    session_id_t id = session->id;
+    driver.latest(session, [&conn, id](const snapshot_ptr &snapshot)
+                  {
+        if (!snapshot)
+        {
+            return;
+        }
+        std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+        auto it = subscribers.find(&conn);
+        if (it != subscribers.end() && it->second.session == id)
+        {
+            push_frame(conn, it->second, *snapshot);
+        } });
+}
+
+// Writes the region of a snapshot given by ?row=..&col=..&rows=..&cols=..,
+// clipped to the world, as a binary keyframe or as JSON, with the size of
+// the whole world in X-World-Rows and X-World-Cols. Answers 400 for a
+// region outside the world.
+void write_region(const crow::request &req, crow::response &res, const snapshot_t &snapshot, bool binary)
+{
+    auto param = [&req](const char *name, uint64_t fallback)
     {
-        entity_grid[pos.i+1][pos.j].m-> lock();   
-    }
-    if (pos.i > 0)
+        const char *value = req.url_params.get(name);
+        return value ? std::strtoull(value, nullptr, 10) : fallback;
+    };
+    uint64_t fallback = snapshot.chunked ? DEFAULT_REGION_DIMENSION : MAXIMUM_GRID_DIMENSION;
+    uint64_t row = param("row", 0);
+    uint64_t col = param("col", 0);
+    uint64_t rows = param("rows", fallback);
+    uint64_t cols = param("cols", fallback);
+    if (row >= snapshot.rows() || col >= snapshot.cols() || rows == 0 || cols == 0 || rows > MAXIMUM_GRID_DIMENSION ||
+        cols > MAXIMUM_GRID_DIMENSION)
     {
-        entity_grid[pos.i-1][pos.j].m-> lock();
+        res.code = 400;
+        res.body = "Invalid region";
+        return;
     }
-    if (pos.j + 1 < NUM_ROWS)
+    rows = std::min(rows, snapshot.rows() - row);
+    cols = std::min(cols, snapshot.cols() - col);
+    grid_t region = snapshot.region((uint32_t)row, (uint32_t)col, (uint32_t)rows, (uint32_t)cols);
+
+    res.set_header("X-World-Rows", std::to_string(snapshot.rows()));
+    res.set_header("X-World-Cols", std::to_string(snapshot.cols()));
+    if (binary)
     {
-        entity_grid[pos.i][pos.j+1].m-> lock();
+        res.set_header("Content-Type", SNAPSHOT_CONTENT_TYPE);
+        res.body = encode_keyframe(region, snapshot.run, snapshot.tick);
     }
-    if (pos.j > 0)
+    else
     {
-        entity_grid[pos.i][pos.j-1].m-> lock();
+        nlohmann::json json_grid = region;
+        res.body = json_grid.dump();
     }
 }
 
-void unlock(pos_t pos){
-    entity_grid[pos.i][pos.j].m-> unlock();  
-    if (pos.i + 1 < NUM_ROWS)
+// Writes a snapshot as a binary frame when the client accepts one, and as
+// JSON otherwise. Binary clients that pass the run and tick of the last
+// frame they hold (?run=..&since=..) get a delta against it. Requests for a
+// region, and every read of a chunked world, get a region instead.
+void write_grid(const crow::request &req, crow::response &res, const snapshot_t &snapshot)
+{
+    bool binary = req.get_header_value("Accept").find(SNAPSHOT_CONTENT_TYPE) != std::string::npos;
+    if (snapshot.chunked || req.url_params.get("row") || req.url_params.get("col") || req.url_params.get("rows") ||
+        req.url_params.get("cols"))
     {
-        entity_grid[pos.i+1][pos.j].m-> unlock();   
+        write_region(req, res, snapshot, binary);
     }
-    if (pos.i > 0)
+    else if (binary)
     {
-        entity_grid[pos.i-1][pos.j].m-> unlock();
+        res.set_header("Content-Type", SNAPSHOT_CONTENT_TYPE);
+        const char *run = req.url_params.get("run");
+        const char *since = req.url_params.get("since");
+        res.body = encode_frame(snapshot, run && since, run ? (uint32_t)std::strtoul(run, nullptr, 10) : 0,
+                                since ? std::strtoull(since, nullptr, 10) : 0);
     }
-    if (pos.j + 1 < NUM_ROWS)
+    else
     {
-        entity_grid[pos.i][pos.j+1].m-> unlock();
+        nlohmann::json json_grid = snapshot.grid;
+        res.body = json_grid.dump();
     }
-    if (pos.j > 0)
-    {
-        entity_grid[pos.i][pos.j-1].m-> unlock();
-    }  
 }
 
-pos_t check_empty(pos_t pos, std::vector<pos_t> occupied_pos)
+// Reads a seed map given as one string per row into a row-major array of
+// entity types, setting rows and cols to its size
+bool read_map(const nlohmann::json &json_map, std::vector<entity_type_t> &map, uint32_t &rows, uint32_t &cols)
 {
-    pos_t aux;
-    if (pos.i + 1 < NUM_ROWS)
+    if (!json_map.is_array() || json_map.empty() || json_map.size() > MAXIMUM_GRID_DIMENSION || !json_map[0].is_string() ||
+        json_map[0].get_ref<const std::string &>().size() > MAXIMUM_GRID_DIMENSION)
     {
-        aux.i = i + 1;
-        aux.j = j;
-
-        if (entity_grid[pos.i + 1][pos.j].type == empty && check_availability(aux, occupied_pos))
+        return false;
+    }
+    rows = (uint32_t)json_map.size();
+    cols = (uint32_t)json_map[0].get_ref<const std::string &>().size();
+    map.reserve((size_t)rows * cols);
+    for (const nlohmann::json &json_row : json_map)
+    {
+        if (!json_row.is_string() || json_row.get_ref<const std::string &>().size() != cols)
         {
-            valid_pos.push_back({pos.i + 1, pos.j});
+            return false;
+        }
+        for (char c : json_row.get_ref<const std::string &>())
+        {
+            switch (c)
+            {
+            case ' ':
+            case '.':
+                map.push_back(empty);
+                break;
+            case 'P':
+                map.push_back(plant);
+                break;
+            case 'H':
+                map.push_back(herbivore);
+                break;
+            case 'C':
+                map.push_back(carnivore);
+                break;
+            default:
+                return false;
+            }
         }
     }
-    if (pos.i > 0)
-    {
-        aux.i = i - 1;
-        aux.j = j;
+    return true;
+}
 
-        if (entity_grid[pos.i - 1][pos.j].type == empty && check_availability(aux, occupied_pos))
+// Answers 400 with message and returns false
+bool reject(crow::response &res, const std::string &message)
+{
+    res.code = 400;
+    res.body = message;
+    res.end();
+    return false;
+}
+
+// Reads a simulation configuration from a /start-simulation style body,
+// answering 400 and returning false when it is invalid
+bool read_config(const crow::request &req, crow::response &res, simulation_config_t &config)
+{
+    // Parse the JSON request body
+    nlohmann::json request_body = nlohmann::json::parse(req.body);
+
+    // Validate the request body
+    std::vector<entity_type_t> map;
+    uint32_t rows = request_body.value("rows", DEFAULT_NUM_ROWS);
+    uint32_t cols = request_body.value("cols", rows);
+    if (request_body.contains("map"))
+    {
+        // One string per row, with ' ' or '.' for empty cells and P, H, C
+        // for the species, as in the JSON grid
+        if (!read_map(request_body["map"], map, rows, cols))
         {
-            valid_pos.push_back({pos.i - 1, pos.j});
+            return reject(res, "Invalid map");
         }
     }
-    if (pos.j + 1 < NUM_ROWS)
+    bool chunked = rows > MAXIMUM_GRID_DIMENSION || cols > MAXIMUM_GRID_DIMENSION;
+    if (rows == 0 || cols == 0 || rows > MAXIMUM_CHUNKED_DIMENSION || cols > MAXIMUM_CHUNKED_DIMENSION)
     {
-        aux.i = i;
-        aux.j = j + 1;
+        return reject(res, "Invalid grid dimensions");
+    }
 
-        if (entity_grid[pos.i][pos.j + 1].type == empty && check_availability(aux, occupied_pos))
-        {
-            valid_pos.push_back({pos.i, pos.j + 1});
-        }
+    uint32_t plants = request_body.value("plants", 0u);
+    uint32_t herbivores = request_body.value("herbivores", 0u);
+    uint32_t carnivores = request_body.value("carnivores", 0u);
+    uint64_t total_entinties = (uint64_t)plants + herbivores + carnivores;
+    if (total_entinties > (uint64_t)rows * cols || (chunked && total_entinties > MAXIMUM_CHUNKED_ENTITIES))
+    {
+        return reject(res, "Too many entities");
+    }
+
+    uint32_t workers = request_body.value("workers", thread_pool_t::default_concurrency());
+    if (workers == 0 || workers > MAXIMUM_WORKERS)
+    {
+        return reject(res, "Invalid number of workers");
     }
-    if (pos.j > 0)
+    uint64_t seed = request_body.contains("seed") ? request_body["seed"].get<uint64_t>() : simulation_t::random_seed();
+
+    // Edges either bound the grid or wrap around to the opposite side
+    std::string topology = request_body.value("topology", std::string("bounded"));
+    if ((topology != "bounded" && topology != "toroidal") || (chunked && topology != "bounded"))
     {
-        aux.i = i;
-        aux.j = j - 1;
+        return reject(res, "Invalid topology");
+    }
 
-        if (entity_grid[pos.i][pos.j - 1].type == empty && check_availability(aux, occupied_pos))
+    config = simulation_config_t{rows, cols, seed, plants, herbivores, carnivores, workers};
+    config.map = std::move(map);
+    config.topology = topology == "toroidal" ? toroidal : bounded;
+    config.chunked = chunked;
+
+    // Per-cell probabilities instead of exact counts, with plants optionally
+    // in patches of about patch_scale cells
+    if (config.map.empty() && request_body.contains("densities"))
+    {
+        if (chunked || !request_body["densities"].is_object())
+        {
+            return reject(res, "Invalid densities");
+        }
+        const nlohmann::json &densities = request_body["densities"];
+        config.use_densities = true;
+        config.densities[plant] = densities.value("plants", 0.0);
+        config.densities[herbivore] = densities.value("herbivores", 0.0);
+        config.densities[carnivore] = densities.value("carnivores", 0.0);
+        config.patch_scale = request_body.value("patch_scale", 0.0);
+        bool valid = config.patch_scale == 0 || (config.patch_scale >= 1 && config.patch_scale <= MAXIMUM_GRID_DIMENSION);
+        for (entity_type_t type : {plant, herbivore, carnivore})
+        {
+            valid = valid && config.densities[type] >= 0 && config.densities[type] <= 1;
+        }
+        if (!valid || config.densities[plant] + config.densities[herbivore] + config.densities[carnivore] > 1)
         {
-            valid_pos.push_back({pos.i, pos.j - 1});
+            return reject(res, "Invalid densities");
         }
     }
-    if (!valid_pos.empty())
+    return true;
+}
+
+// Answers 404 and returns false when a session lookup came back empty
+bool check_session(crow::response &res, const session_ptr &session)
+{
+    if (!session)
     {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, valid_pos.size() - 1);
-        pos_aleatoria = valid_pos[dis(gen)];
-        valid_pos.clear();
-        return pos_aleatoria;
+        res.code = 404;
+        res.body = "Unknown simulation";
+        res.end();
+        return false;
     }
-    else
+    return true;
+}
+
+// Completion of a driver command that finishes the response, so that no
+// I/O thread ever waits for a step: respond fills in the response from the
+// command's snapshot on the driver worker, and the response is then ended
+// on the request's I/O thread. A session deleted before the command ran is
+// answered with 404. The connection keeps req and res alive until then.
+completion_t respond_later(const crow::request &req, crow::response &res, std::function<void(const snapshot_ptr &)> respond)
+{
+    boost::asio::io_service *io_service = req.io_service;
+    return [io_service, &res, respond](const snapshot_ptr &snapshot)
     {
-        return pos;
+        if (!snapshot)
+        {
+            io_service->post([&res]()
+                             { check_session(res, nullptr); });
+            return;
+        }
+        respond(snapshot);
+        io_service->post([&res]()
+                         { res.end(); });
+    };
+}
+
+// Restarts a session from the request body and returns its first grid
+void start_session(const crow::request &req, crow::response &res, const session_ptr &session)
+{
+    simulation_config_t config;
+    if (!check_session(res, session) || !read_config(req, res, config))
+    {
+        return;
     }
+    driver.restart(session, config, respond_later(req, res, [&req, &res, seed = config.seed](const snapshot_ptr &snapshot)
+                                                  {
+        // Return the representation of the entity grid
+        res.set_header("X-Simulation-Seed", std::to_string(seed));
+        write_grid(req, res, *snapshot); }));
 }
 
-// pos_t check_plants(pos_t pos, std::vector<pos_t> occupied_pos)
-// {
-//     pos_t aux;
-//     if (pos.i + 1 < NUM_ROWS)
-//     {
-//         entity_grid[pos.i + 1][pos.j].m.lock();
-//         aux.i = i + 1;
-//         aux.j = j;
-
-//         if (entity_grid[pos.i + 1][pos.j].type == plant && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i + 1, pos.j});
-//         }
-//     }
-//     if (pos.i > 0)
-//     {
-//         entity_grid[pos.i - 1][pos.j].m.lock();
-//         aux.i = i - 1;
-//         aux.j = j;
-
-//         if (entity_grid[pos.i - 1][pos.j].type == plant && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i - 1, pos.j});
-//         }
-//     }
-//     if (pos.j + 1 < NUM_ROWS)
-//     {
-//         entity_grid[pos.i][pos.j+1].m.lock();
-//         aux.i = i;
-//         aux.j = j + 1;
-
-//         if (entity_grid[pos.i][pos.j + 1].type == plant && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i, pos.j + 1});
-//         }
-//     }
-//     if (pos.j > 0)
-//     {
-//         entity_grid[pos.i][pos.j-1].m.lock();
-//         aux.i = i;
-//         aux.j = j - 1;
-
-//         if (entity_grid[pos.i][pos.j - 1].type == plant && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i, pos.j - 1});
-//         }
-//     }
-//     if (!valid_pos.empty())
-//     {
-//         static std::random_device rd;
-//         static std::mt19937 gen(rd());
-//         std::uniform_int_distribution<> dis(0, valid_pos.size() - 1);
-//         pos_aleatoria = valid_pos[dis(gen)];
-//         valid_pos.clear();
-//         return pos_aleatoria;
-//     }
-//     else
-//     {
-//         return pos;
-//     }
-// }
-
-// pos_t check_herbivores(pos_t pos, std::vector<pos_t> occupied_pos)
-// {
-//     pos_t aux;
-//     if (pos.i + 1 < NUM_ROWS)
-//     {
-//         entity_grid[pos.i+1][pos.j].m.lock();
-//         aux.i = i + 1;
-//         aux.j = j;
-//         if (entity_grid[pos.i + 1][pos.j].type == herbivore && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i + 1, pos.j});
-//         }
-//     }
-//     if (pos.i > 0)
-//     {
-//         entity_grid[pos.i-1][pos.j].m.lock();
-//         aux.i = i - 1;
-//         aux.j = j;
-//         if (entity_grid[pos.i - 1][pos.j].type == herbivore && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i - 1, pos.j});
-//         }
-//     }
-//     if (pos.j + 1 < NUM_ROWS)
-//     {
-//         entity_grid[pos.i][pos.j+1].m.lock();
-//         aux.i = i;
-//         aux.j = j + 1;
-//         if (entity_grid[pos.i][pos.j + 1].type == herbivore && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i, pos.j + 1});
-//         }
-//     }
-//     if (pos.j > 0)
-//     {
-//         entity_grid[pos.i][pos.j-1].m.lock();
-//         aux.i = i;
-//         aux.j = j - 1;
-//         if (entity_grid[pos.i][pos.j - 1].type == herbivore && check_availability(aux, occupied_pos))
-//         {
-//             valid_pos.push_back({pos.i, pos.j - 1});
-//         }
-//     }
-//     if (!valid_pos.empty())
-//     {
-//         static std::random_device rd;
-//         static std::mt19937 gen(rd());
-//         std::uniform_int_distribution<> dis(0, valid_pos.size() - 1);
-//         pos_aleatoria = valid_pos[dis(gen)];
-//         valid_pos.clear();
-//         return pos_aleatoria;
-//     }
-//     else
-//     {
-//         return pos;
-//     }
-// }
-
-// pos_t eat_plant = check_plants(pos, occupied_pos);
-// pos_t eat_herb = check_herbivores(pos, occupied_pos);
-
-void simulate_plant(pos_t pos)
+// Advances a session and returns either its grid or, with summary set, only
+// summary statistics
+void advance_session(const crow::request &req, crow::response &res, const session_ptr &session, uint32_t steps, bool summary)
 {
-    lock(pos);
-    if (random_action(PLANT_REPRODUCTION_PROBABILITY))
+    if (!check_session(res, session))
     {
-        pos_t nova_pos = check_empty(pos, occupied_pos);
-        if (entity_grid[nova_pos.i][nova_pos.j].type == empty)
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    driver.advance(session, steps, respond_later(req, res, [&req, &res, start, summary](const snapshot_ptr &snapshot)
+                                                 {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (summary)
         {
-            entity_grid[nova_pos.i][nova_pos.j].type = plant;
-            entity_grid[nova_pos.i][nova_pos.j].age = 0;
-            occupied_pos.push_back(nova_pos);
+            std::vector<uint64_t> counts = snapshot->census();
+            nlohmann::json json_summary = {{"tick", snapshot->tick},
+                                           {"plants", counts[plant]},
+                                           {"herbivores", counts[herbivore]},
+                                           {"carnivores", counts[carnivore]},
+                                           {"changed_cells", snapshot->changed_cells},
+                                           {"sparse", snapshot->sparse},
+                                           {"skipped_tile_ratio", snapshot->tiles ? (double)snapshot->skipped_tiles / snapshot->tiles : 0.0},
+                                           {"plant_tile_ratio", snapshot->tiles ? (double)snapshot->plant_tiles / snapshot->tiles : 0.0},
+                                           {"elapsed_ms", elapsed.count()},
+                                           {"chunks", snapshot->chunks.size()},
+                                           {"checksum", snapshot->checksum()}};
+            res.body = json_summary.dump();
         }
-    }
-    unlock(pos);  
+        else
+        {
+            write_grid(req, res, *snapshot);
+        } }));
 }
 
-// void simulate_herbivore(pos_t pos)
-// {
-//     if (entity_grid[i][j].energy > THRESHOLD_ENERGY_FOR_REPRODUCTION && random_action(HERBIVORE_REPRODUCTION_PROBABILITY))
-//     {
-//         if ((random_action(HERBIVORE_REPRODUCTION_PROBABILITY)))
-//         {
-//             entity_grid[i][j].energy = entity_grid[i][j].energy - 10;
-//             pos_t nova_pos = check_empty(pos, occupied_pos);
-//             if (entity_grid[nova_pos.i][nova_pos.j].type == empty)
-//             {
-//                 entity_grid[nova_pos.i][nova_pos.j].type = herbivore;
-//                 entity_grid[nova_pos.i][nova_pos.j].age = 0;
-//                 entity_grid[nova_pos.i][nova_pos.j].energy = 100;
-//                 occupied_pos.push_back(nova_pos);
-//             }
-//         }
-//     }
-//     else if (eat_plant.i != pos.i || eat_plant.j != pos.j)
-//     {
-//         if (random_action(HERBIVORE_EAT_PROBABILITY))
-//         {
-//             entity_grid[eat_plant.i][eat_plant.j].type = herbivore;
-//             entity_grid[eat_plant.i][eat_plant.j].age = entity_grid[i][j].age;
-
-//             if (entity_grid[i][j].energy <= MAXIMUM_ENERGY - 30)
-//             {
-//                 entity_grid[eat_plant.i][eat_plant.j].energy = entity_grid[i][j].energy + 30;
-//             }
-//             else
-//             {
-//                 entity_grid[eat_plant.i][eat_plant.j].energy = MAXIMUM_ENERGY;
-//             }
-//             entity_grid[i][j].type = empty;
-//             occupied_pos.push_back(eat_plant);
-//         }
-//     }
-//     else if (random_action(HERBIVORE_MOVE_PROBABILITY))
-//     {
-//         pos_t nova_pos = check_empty(pos, occupied_pos);
-//         if (entity_grid[nova_pos.i][nova_pos.j].type == empty)
-//         {
-//             entity_grid[nova_pos.i][nova_pos.j].type = herbivore;
-//             entity_grid[nova_pos.i][nova_pos.j].age = entity_grid[i][j].age;
-//             entity_grid[nova_pos.i][nova_pos.j].energy = entity_grid[i][j].energy - 5;
-//             entity_grid[i][j].type = empty;
-//             occupied_pos.push_back(nova_pos);
-//         }
-//     }
-// }
-
-// void simulate_carnivore(pos_t pos)
-// {
-//     if (entity_grid[i][j].energy > THRESHOLD_ENERGY_FOR_REPRODUCTION && random_action(CARNIVORE_REPRODUCTION_PROBABILITY))
-//     {
-//         entity_grid[i][j].energy = entity_grid[i][j].energy - 10;
-//         pos_t nova_pos = check_empty(pos, occupied_pos);
-//         if (entity_grid[nova_pos.i][nova_pos.j].type == empty)
-//         {
-//             entity_grid[nova_pos.i][nova_pos.j].type = carnivore;
-//             entity_grid[nova_pos.i][nova_pos.j].age = 0;
-//             entity_grid[nova_pos.i][nova_pos.j].energy = 100;
-//             occupied_pos.push_back(nova_pos);
-//         }
-//     }
-//     pos_t eat_herb = check_herbivores(pos, occupied_pos);
-//     if (eat_herb.i != pos.i || eat_herb.j != pos.j)
-//     {
-//         if (random_action(CARNIVORE_EAT_PROBABILITY))
-//         {
-//             entity_grid[eat_herb.i][eat_herb.j].type = carnivore;
-//             if (entity_grid[i][j].energy <= MAXIMUM_ENERGY - 20)
-//             {
-//                 entity_grid[eat_herb.i][eat_herb.j].energy = entity_grid[i][j].energy + 20;
-//             }
-//             else
-//             {
-//                 entity_grid[eat_herb.i][eat_herb.j].energy = MAXIMUM_ENERGY;
-//             }
-//             entity_grid[eat_herb.i][eat_herb.j].age = entity_grid[i][j].age;
-//             entity_grid[i][j].type = empty;
-//             occupied_pos.push_back(eat_herb);
-//         }
-//     }
-//     else if (random_action(CARNIVORE_MOVE_PROBABILITY))
-//     {
-//         pos_t nova_pos = check_empty(pos, occupied_pos);
-//         if (entity_grid[nova_pos.i][nova_pos.j].type == empty)
-//         {
-//             entity_grid[nova_pos.i][nova_pos.j].type = carnivore;
-//             entity_grid[nova_pos.i][nova_pos.j].age = entity_grid[i][j].age;
-//             entity_grid[nova_pos.i][nova_pos.j].energy = entity_grid[i][j].energy - 5;
-//             entity_grid[i][j].type = empty;
-//             occupied_pos.push_back(nova_pos);
-//         }
-//     }
-// }
+// Handles an /advance style body: {"steps": n, "summary": bool}
+void advance_steps(const crow::request &req, crow::response &res, const session_ptr &session)
+{
+    nlohmann::json request_body = nlohmann::json::parse(req.body);
+    uint32_t steps = request_body.value("steps", 1u);
+    if (steps == 0 || steps > MAXIMUM_ADVANCE_STEPS)
+    {
+        reject(res, "Invalid number of steps");
+        return;
+    }
+    advance_session(req, res, session, steps, request_body.value("summary", false));
+}
 
 int main()
 {
@@ -447,171 +453,186 @@ int main()
     CROW_ROUTE(app, "/start-simulation")
         .methods("POST"_method)([](crow::request &req, crow::response &res)
                                 { 
-        // Parse the JSON request body
-        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        // Clear the entity grid of the default session and create the entities
+        start_session(req, res, driver.find(DEFAULT_SESSION)); });
 
-       // Validate the request body 
-        uint32_t total_entinties = (uint32_t)request_body["plants"] + (uint32_t)request_body["herbivores"] + (uint32_t)request_body["carnivores"];
-        if (total_entinties > NUM_ROWS * NUM_ROWS) {
-        res.code = 400;
-        res.body = "Too many entities";
-        res.end();
-        return;
-        }
+    // Endpoint to process HTTP GET requests for the next simulation iteration
+    CROW_ROUTE(app, "/next-iteration")
+        .methods("GET"_method)([](crow::request &req, crow::response &res)
+                               { advance_session(req, res, driver.find(DEFAULT_SESSION), 1, false); });
 
-        // Clear the entity grid
-        entity_grid.clear();
-        entity_grid.assign(NUM_ROWS, std::vector<entity_t>(NUM_ROWS, { empty, 0, 0, new std::mutex()}));
-        for(i=0; i< NUM_ROWS; i++){
-            for(j=0; j<NUM_ROWS; j++){
-                entity_grid[i][j].m = (new std::mutex);
+    // Endpoint to advance the simulation by several iterations in one request
+    CROW_ROUTE(app, "/advance")
+        .methods("POST"_method)([](crow::request &req, crow::response &res)
+                                { advance_steps(req, res, driver.find(DEFAULT_SESSION)); });
+
+    // Endpoint to create a new session; takes the same body as
+    // /start-simulation and returns {"id": session, "seed": seed}
+    CROW_ROUTE(app, "/simulations")
+        .methods("POST"_method)([](crow::request &req, crow::response &res)
+                                {
+        simulation_config_t config;
+        if (!read_config(req, res, config)) {
+            return;
+        }
+        session_ptr session = driver.create();
+        driver.restart(session, config, respond_later(req, res, [&res, id = session->id, seed = config.seed](const snapshot_ptr &) {
+            nlohmann::json created = {{"id", id}, {"seed", seed}};
+            res.body = created.dump();
+        })); });
+
+    // Latest published grid of a session, or the grid after its next tick
+    CROW_ROUTE(app, "/simulations/<uint>")
+        .methods("GET"_method, "DELETE"_method)([](crow::request &req, crow::response &res, uint64_t id)
+                                                {
+        session_ptr session = driver.find(id);
+        if (!check_session(res, session)) {
+            return;
+        }
+        if (req.method == "DELETE"_method) {
+            if (id == DEFAULT_SESSION) {
+                reject(res, "The default simulation cannot be deleted");
+                return;
+            }
+            if (!driver.remove(id)) {
+                // Deleted by another request in the meantime
+                check_session(res, nullptr);
+                return;
             }
+        } else {
+            driver.latest(session, respond_later(req, res, [&req, &res](const snapshot_ptr &snapshot) {
+                write_grid(req, res, *snapshot);
+            }));
+            return;
         }
-    
-
-        // Create the entities
-        // <YOUR CODE HERE>
-        uint32_t num_plants= (uint32_t)request_body["plants"];
-        uint32_t num_herbivores= (uint32_t)request_body["herbivores"];
-        uint32_t num_carnivores= (uint32_t)request_body["carnivores"];
-
-        int count_p=0;
-        int count_h=0;
-        int count_c=0; 
+        res.end(); });
 
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, 14);
+    CROW_ROUTE(app, "/simulations/<uint>/next")
+        .methods("GET"_method)([](crow::request &req, crow::response &res, uint64_t id)
+                               { advance_session(req, res, driver.find(id), 1, false); });
 
-        while(count_p< num_plants){
-            i= dis(gen);
-            j= dis(gen);
+    CROW_ROUTE(app, "/simulations/<uint>/advance")
+        .methods("POST"_method)([](crow::request &req, crow::response &res, uint64_t id)
+                                { advance_steps(req, res, driver.find(id)); });
 
-            while(entity_grid[i][j].type!= empty){
-                i= dis(gen);
-                j= dis(gen);
-            }
-            entity_grid[i][j].type= plant;
-            entity_grid[i][j].age= 0;
-            count_p++;
+    // Endpoint with server-wide counters: sessions, memory held, and how
+    // often the shared locks were found held by another thread
+    CROW_ROUTE(app, "/metrics")
+        .methods("GET"_method)([](crow::request &, crow::response &res)
+                               {
+        driver_stats_t stats = driver.stats();
+        size_t subscriber_count;
+        {
+            std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+            subscriber_count = subscribers.size();
         }
+        nlohmann::json metrics = {{"sessions", stats.sessions},
+                                  {"resident_sessions", stats.resident_sessions},
+                                  {"session_bytes", stats.bytes},
+                                  {"subscribers", subscriber_count},
+                                  {"workers", driver.concurrency()},
+                                  {"locks", {{"driver", {{"acquisitions", stats.lock_acquisitions}, {"contentions", stats.lock_contentions}}},
+                                             {"pool", {{"acquisitions", stats.pool_lock_acquisitions}, {"contentions", stats.pool_lock_contentions}}},
+                                             {"subscribers", {{"acquisitions", subscribers_mutex.acquisitions()}, {"contentions", subscribers_mutex.contentions()}}}}}};
+        res.body = metrics.dump();
+        res.end(); });
 
-        while(count_h< num_herbivores){
-            pos_t pos_herbivore;
-            i= dis(gen);
-            j= dis(gen);
-
-            while(entity_grid[i][j].type!= empty){
-                i= dis(gen);
-                j= dis(gen);
-            }
-            entity_grid[i][j].type= herbivore;
-            entity_grid[i][j].age= 0;
-            entity_grid[i][j].energy= 100;
-            count_h++;
+    // WebSocket stream of simulation frames. Clients send JSON text messages:
+    // {"session": id} to follow a session other than the default one,
+    // {"rate": ticks per second} to run it on the server (0 pauses it, a
+    // negative rate runs it as fast as possible; the session is paused again
+    // once no client follows it any more), and
+    // {"run": id, "ack": tick} after applying each frame. Run 0 is never
+    // used, so a client that could not apply a frame acknowledges run 0 to
+    // get a keyframe.
+    CROW_ROUTE(app, "/ws")
+        .websocket()
+        .onopen([](crow::websocket::connection &conn)
+                {
+        {
+            std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+            subscribers[&conn].serial = next_subscriber_serial++;
         }
-
-        while(count_c< num_carnivores){
-            pos_t pos_carnivore; 
-            i= dis(gen);
-            j= dis(gen);
-
-            while(entity_grid[i][j].type!= empty){
-                i= dis(gen);
-                j= dis(gen);
+        catch_up(conn, driver.find(DEFAULT_SESSION)); })
+        .onclose([](crow::websocket::connection &conn, const std::string &)
+                 {
+        std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+        auto it = subscribers.find(&conn);
+        if (it == subscribers.end()) {
+            return;
+        }
+        session_id_t id = it->second.session;
+        subscribers.erase(it);
+        release_rate(id); })
+        .onmessage([](crow::websocket::connection &conn, const std::string &data, bool is_binary)
+                   {
+        nlohmann::json message = nlohmann::json::parse(data, nullptr, false);
+        if (is_binary || !message.is_object()) {
+            return;
+        }
+        // Messages with a field of the wrong type are ignored as a whole
+        for (const char *field : {"session", "run", "ack"}) {
+            if (message.contains(field) && !message[field].is_number_unsigned()) {
+                return;
             }
-            entity_grid[i][j].type= carnivore;
-            entity_grid[i][j].age= 0;
-            entity_grid[i][j].energy= 100;
-            count_c++;
         }
-
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        res.body = json_grid.dump();
-        res.end(); });
-
-    // Endpoint to process HTTP GET requests for the next simulation iteration
-    CROW_ROUTE(app, "/next-iteration")
-        .methods("GET"_method)([]()
-                               {
-        // Simulate the next iteration
-        // Iterate over the entity grid and simulate the behaviour of each entity
-        
-        // <YOUR CODE HERE> 
-    // std::vector<pos_t> occupied_pos; 
-    // pos_t current_pos;
-
-    for (int i = 0; i < NUM_ROWS; i++)
-    {
-        for (int j = 0; j < NUM_ROWS; j++)
+        if (message.contains("rate") && !message["rate"].is_number()) {
+            return;
+        }
+        session_id_t id;
         {
-            current_pos.i = i;
-            current_pos.j = j;
-            if(check_availability(current_pos, occupied_pos)){
-                if (entity_grid[i][j].type != empty)
-                {
-                    if (entity_grid[i][j].type == plant && entity_grid[i][j].age == PLANT_MAXIMUM_AGE ||
-                        entity_grid[i][j].type == herbivore && (entity_grid[i][j].age == HERBIVORE_MAXIMUM_AGE || entity_grid[i][j].energy == 0) ||
-                        entity_grid[i][j].type == carnivore && (entity_grid[i][j].age == CARNIVORE_MAXIMUM_AGE || entity_grid[i][j].energy == 0))
-                    {
-                        entity_grid[i][j].type = empty;
-                        entity_grid[i][j].age = 0;
-                    }
-                    else
-                    {
-                        entity_grid[i][j].age++;
-                    }
-
-                    if (entity_grid[i][j].type == plant)
-                    {
-                        pos_t pos;
-                        pos.i = i;
-                        pos.j = j;
-                        
-                        //entity_grid[pos.i][pos.j].m-> lock();   
-                        lock(pos);
-                        threads.emplace_back(simulate_plant, pos); 
-                        // std::thread p(simulate_plant, pos);    
-                        // p.join();
-                    }
-                      
-
-                    // if (entity_grid[i][j].type == herbivore)
-                    // {
-                    //     pos_t pos;
-                    //     pos.i = i;
-                    //     pos.j = j;
-                    //     entity_grid[i][j].m-> lock();
-
-                    //     std::thread h(simulate_plant, pos);
-                    //     h.join();
-                    // }
-                    
-                    // if (entity_grid[i][j].type == carnivore)
-                    // {
-                    //     pos_t pos;
-                    //     pos.i = i;
-                    //     pos.j = j;
-                    //     entity_grid[i][j].m-> lock();
-
-                    //     std::thread c(simulate_plant, pos);
-                    //     c.join();
-                    // }
+            std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+            auto it = subscribers.find(&conn);
+            if (it == subscribers.end()) {
+                return;
+            }
+            if (message.contains("session")) {
+                // Run ids are unique across sessions, so the next frame of the
+                // new session is a keyframe
+                session_id_t previous = it->second.session;
+                it->second.session = message["session"].get<session_id_t>();
+                if (previous != it->second.session) {
+                    release_rate(previous);
                 }
-            } 
+            }
+            if (message.contains("ack")) {
+                it->second.has_frame = true;
+                it->second.in_flight = false;
+                it->second.run = message.value("run", 0u);
+                it->second.acked_tick = message["ack"].get<uint64_t>();
+            }
+            id = it->second.session;
+        }
+        session_ptr session = driver.find(id);
+        if (!session) {
+            return;
         }
-    }
 
-    for (std::thread& thread : threads)
-    {
-        thread.join();
-    }
+        // Catch up right away if the session moved on in the meantime
+        catch_up(conn, session);
+
+        if (message.contains("rate")) {
+            double rate = std::min(message["rate"].get<double>(), MAXIMUM_STREAM_RATE);
+            std::lock_guard<counted_mutex_t> guard(subscribers_mutex);
+            auto it = subscribers.find(&conn);
+            if (it != subscribers.end() && it->second.session == id) {
+                if (rate != 0) {
+                    streamed_sessions.insert(id);
+                } else {
+                    streamed_sessions.erase(id);
+                }
+                driver.set_rate(session, rate);
+            }
+        } });
+
+    // Optional cap on the memory held by all sessions, in megabytes; idle
+    // sessions beyond it are spilled to ECOSIM_SPILL_DIR, or dropped without it
+    const char *budget = std::getenv("ECOSIM_MEMORY_BUDGET_MB");
+    const char *spill_dir = std::getenv("ECOSIM_SPILL_DIR");
+    driver.set_memory_budget(budget ? (size_t)std::strtoull(budget, nullptr, 10) << 20 : 0, spill_dir ? spill_dir : "");
 
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        return json_grid.dump(); });
-    app.port(8080).run();
+    driver.start(publish_frames);
+    app.port(8080).multithreaded().run();
 
     return 0;
 }
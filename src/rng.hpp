@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// SplitMix64 finalizer: a cheap bijective mix of a 64-bit value
+inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Key shared by every cell stream of one tick
+inline uint64_t tick_key(uint64_t seed, uint64_t tick)
+{
+    return splitmix64(splitmix64(seed) ^ tick);
+}
+
+// Counter-based random stream for one cell in one tick. The n-th draw is a
+// pure function of (seed, tick, cell, n), so streams need no shared state,
+// cost a couple of multiplies per draw, and give the same numbers no matter
+// which thread evaluates them or in which order.
+struct cell_rng_t
+{
+    uint64_t key;
+    uint64_t counter = 0;
+
+    cell_rng_t(uint64_t tick_key, uint64_t cell) : key(splitmix64(tick_key ^ cell))
+    {
+    }
+
+    uint64_t next()
+    {
+        return splitmix64(key + 0x632be59bd9b4e019ULL * ++counter);
+    }
+
+    // Uniform double in [0, 1)
+    double uniform()
+    {
+        return (next() >> 11) * 0x1.0p-53;
+    }
+
+    // Uniform integer in [0, n)
+    uint32_t below(uint32_t n)
+    {
+        return (uint32_t)(((next() >> 32) * n) >> 32);
+    }
+
+    bool chance(double probability)
+    {
+        return uniform() < probability;
+    }
+};
+
+// Keyed pseudo-random permutation of [0, size): a four-round Feistel network
+// over the smallest even number of bits that covers size, cycle-walking
+// values that fall outside the range. Every value maps on its own, so any
+// part of the permutation can be evaluated in any order or in parallel.
+struct index_permutation_t
+{
+    uint64_t round_keys[4];
+    uint64_t size;
+    uint32_t half_bits = 1;
+
+    index_permutation_t(uint64_t key, uint64_t permutation_size) : size(permutation_size)
+    {
+        for (uint64_t round = 0; round < 4; round++)
+        {
+            round_keys[round] = splitmix64(key + round);
+        }
+        while ((1ULL << (2 * half_bits)) < size)
+        {
+            half_bits++;
+        }
+    }
+
+    // Image of x, which must be below size
+    uint64_t operator()(uint64_t x) const
+    {
+        uint64_t mask = (1ULL << half_bits) - 1;
+        do
+        {
+            uint64_t left = x >> half_bits;
+            uint64_t right = x & mask;
+            for (uint64_t round_key : round_keys)
+            {
+                uint64_t mixed = left ^ (splitmix64(round_key ^ right) & mask);
+                left = right;
+                right = mixed;
+            }
+            x = left << half_bits | right;
+        } while (x >= size);
+        return x;
+    }
+
+    // Preimage of y, which must be below size: the rounds run backwards
+    uint64_t inverse(uint64_t y) const
+    {
+        uint64_t mask = (1ULL << half_bits) - 1;
+        do
+        {
+            uint64_t left = y >> half_bits;
+            uint64_t right = y & mask;
+            for (int round = 3; round >= 0; round--)
+            {
+                uint64_t mixed = right ^ (splitmix64(round_keys[round] ^ left) & mask);
+                right = left;
+                left = mixed;
+            }
+            y = left << half_bits | right;
+        } while (y >= size);
+        return y;
+    }
+};
+
+// Smooth 2D value noise in [0, 1): a random value at every integer lattice
+// point, keyed like the cell streams, blended across each square with a
+// smoothstep. A pure function of (key, x, y), like the cell streams.
+inline double value_noise(uint64_t key, double x, double y)
+{
+    double x_floor = std::floor(x);
+    double y_floor = std::floor(y);
+    int64_t i = (int64_t)x_floor;
+    int64_t j = (int64_t)y_floor;
+    auto lattice = [key](int64_t a, int64_t b)
+    {
+        return (splitmix64(key ^ splitmix64((uint64_t)a * 0x9e3779b97f4a7c15ULL ^ (uint64_t)b)) >> 11) * 0x1.0p-53;
+    };
+    double fx = x - x_floor;
+    double fy = y - y_floor;
+    double sx = fx * fx * (3 - 2 * fx);
+    double sy = fy * fy * (3 - 2 * fy);
+    double top = lattice(i, j) + (lattice(i + 1, j) - lattice(i, j)) * sx;
+    double bottom = lattice(i, j + 1) + (lattice(i + 1, j + 1) - lattice(i, j + 1)) * sx;
+    return top + (bottom - top) * sy;
+}
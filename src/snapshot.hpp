@@ -0,0 +1,284 @@
+#pragma once
+
+#include "chunked_world.hpp"
+#include "grid.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Immutable copy of one generation, shared with readers once published
+struct snapshot_t
+{
+    grid_t grid;
+    std::vector<uint32_t> changed_tick;
+    uint64_t tick = 0;
+    uint64_t seed = 0;
+    uint64_t changed_cells = 0;
+    uint32_t run = 0;
+    // How the last tick was stepped: by the sparse engine, or by the dense
+    // one with this many of its tiles skipped or only aged
+    bool sparse = false;
+    uint32_t tiles = 0;
+    uint32_t skipped_tiles = 0;
+    uint32_t plant_tiles = 0;
+    // A chunked world publishes its chunks, shared with the world, instead
+    // of a grid, and is read through regions
+    bool chunked = false;
+    uint32_t world_rows = 0;
+    uint32_t world_cols = 0;
+    chunk_map_t chunks;
+
+    uint32_t rows() const
+    {
+        return chunked ? world_rows : grid.rows;
+    }
+
+    uint32_t cols() const
+    {
+        return chunked ? world_cols : grid.cols;
+    }
+
+    // Copies a rectangle of the world into a grid; cells past its edges are
+    // empty
+    grid_t region(uint32_t row, uint32_t col, uint32_t num_rows, uint32_t num_cols) const
+    {
+        grid_t view;
+        view.reset(num_rows, num_cols);
+        if (chunked)
+        {
+            copy_chunks(chunks, world_rows, world_cols, view, row, col);
+            return view;
+        }
+        uint32_t row_end = std::min<uint64_t>(grid.rows, (uint64_t)row + num_rows);
+        uint32_t col_end = std::min<uint64_t>(grid.cols, (uint64_t)col + num_cols);
+        for (uint32_t i = row; i < row_end && col < col_end; i++)
+        {
+            size_t from = grid.index(i, col);
+            size_t to = view.index(i - row, 0);
+            std::copy_n(&grid.type[from], col_end - col, &view.type[to]);
+            std::copy_n(&grid.energy[from], col_end - col, &view.energy[to]);
+            std::copy_n(&grid.age[from], col_end - col, &view.age[to]);
+        }
+        return view;
+    }
+
+    // Number of entities of each type, indexed by entity_type_t
+    std::vector<uint64_t> census() const
+    {
+        if (!chunked)
+        {
+            return grid.census();
+        }
+        std::vector<uint64_t> counts(4, 0);
+        for (const auto &entry : chunks)
+        {
+            std::vector<uint64_t> chunk_counts = entry.second->census();
+            for (uint32_t type = 0; type < 4; type++)
+            {
+                counts[type] += chunk_counts[type];
+            }
+        }
+        // Chunks hold only part of the world's empty cells
+        counts[empty] = (uint64_t)world_rows * world_cols - counts[plant] - counts[herbivore] - counts[carnivore];
+        return counts;
+    }
+
+    // The grid's checksum; for a chunked world, FNV-1a over the checksums of
+    // its chunks in key order, so it does not match a grid of the same cells
+    uint64_t checksum() const
+    {
+        if (!chunked)
+        {
+            return grid.checksum();
+        }
+        std::vector<uint64_t> keys;
+        keys.reserve(chunks.size());
+        for (const auto &entry : chunks)
+        {
+            keys.push_back(entry.first);
+        }
+        std::sort(keys.begin(), keys.end());
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (uint64_t key : keys)
+        {
+            hash = (hash ^ key) * 0x100000001b3ULL;
+            hash = (hash ^ chunks.at(key)->checksum()) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+};
+
+// Binary grid snapshot, served to clients that send
+// "Accept: application/octet-stream". All fields are little-endian.
+//
+//   offset  size  field
+//        0     4  magic "ECOS"
+//        4     2  format version (1)
+//        6     2  frame kind (0 = keyframe, 1 = delta)
+//        8     4  rows
+//       12     4  cols
+//       16     8  tick
+//       24     8  base tick (the tick a delta applies to; equals tick for keyframes)
+//       32     4  cell count
+//       36     4  run id (changes whenever the simulation is restarted)
+//       40        keyframe: int16 energy[count], int16 age[count], uint8 type[count]
+//                 delta:    uint32 index[count], int16 energy[count],
+//                           int16 age[count], uint8 type[count]
+//
+// Cells are row-major without the grid's stride padding; delta indices are
+// row-major cell numbers. The arrays are ordered by element size so each one
+// is naturally aligned for typed-array views on the client.
+static const char SNAPSHOT_MAGIC[4] = {'E', 'C', 'O', 'S'};
+static const uint16_t SNAPSHOT_VERSION = 1;
+static const size_t SNAPSHOT_HEADER_SIZE = 40;
+static constexpr const char SNAPSHOT_CONTENT_TYPE[] = "application/octet-stream";
+
+enum frame_kind_t : uint16_t
+{
+    keyframe,
+    delta
+};
+
+// A client further behind than this gets a keyframe instead of a delta
+static const uint64_t MAXIMUM_DELTA_LAG = 64;
+
+struct snapshot_header_t
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t kind;
+    uint32_t rows;
+    uint32_t cols;
+    uint64_t tick;
+    uint64_t base_tick;
+    uint32_t count;
+    uint32_t run;
+};
+static_assert(sizeof(snapshot_header_t) == SNAPSHOT_HEADER_SIZE, "snapshot header must be packed");
+
+inline void write_snapshot_header(std::string &out, frame_kind_t kind, const grid_t &grid, uint32_t run, uint64_t tick, uint64_t base_tick, uint32_t count)
+{
+    snapshot_header_t header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.kind = kind;
+    header.rows = grid.rows;
+    header.cols = grid.cols;
+    header.tick = tick;
+    header.base_tick = base_tick;
+    header.count = count;
+    header.run = run;
+    out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+// Encodes the whole grid as a keyframe
+inline std::string encode_keyframe(const grid_t &grid, uint32_t run, uint64_t tick)
+{
+    size_t count = (size_t)grid.rows * grid.cols;
+    std::string out;
+    out.reserve(SNAPSHOT_HEADER_SIZE + count * 5);
+    write_snapshot_header(out, keyframe, grid, run, tick, tick, (uint32_t)count);
+    for (uint32_t i = 0; i < grid.rows; i++)
+    {
+        out.append(reinterpret_cast<const char *>(&grid.energy[grid.index(i, 0)]), grid.cols * sizeof(int16_t));
+    }
+    for (uint32_t i = 0; i < grid.rows; i++)
+    {
+        out.append(reinterpret_cast<const char *>(&grid.age[grid.index(i, 0)]), grid.cols * sizeof(int16_t));
+    }
+    for (uint32_t i = 0; i < grid.rows; i++)
+    {
+        out.append(reinterpret_cast<const char *>(&grid.type[grid.index(i, 0)]), grid.cols);
+    }
+    return out;
+}
+
+// Decodes a keyframe written by encode_keyframe, resetting grid to its
+// dimensions. Returns false when data does not start with a whole keyframe.
+inline bool decode_keyframe(const std::string &data, snapshot_header_t &header, grid_t &grid)
+{
+    if (data.size() < SNAPSHOT_HEADER_SIZE)
+    {
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    size_t count = (size_t)header.rows * header.cols;
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.kind != keyframe || header.count != count || data.size() < SNAPSHOT_HEADER_SIZE + count * 5)
+    {
+        return false;
+    }
+
+    grid.reset(header.rows, header.cols);
+    const char *energy = data.data() + SNAPSHOT_HEADER_SIZE;
+    const char *age = energy + count * sizeof(int16_t);
+    const char *type = age + count * sizeof(int16_t);
+    for (uint32_t i = 0; i < grid.rows; i++)
+    {
+        size_t offset = (size_t)i * grid.cols;
+        std::memcpy(&grid.energy[grid.index(i, 0)], energy + offset * sizeof(int16_t), grid.cols * sizeof(int16_t));
+        std::memcpy(&grid.age[grid.index(i, 0)], age + offset * sizeof(int16_t), grid.cols * sizeof(int16_t));
+        std::memcpy(&grid.type[grid.index(i, 0)], type + offset, grid.cols);
+    }
+    return true;
+}
+
+// Encodes the cells whose change stamp is newer than base_tick. Returns false,
+// leaving out untouched, when a keyframe would be smaller: a delta entry
+// takes 9 bytes against 5 per keyframe cell.
+inline bool encode_delta(std::string &out, const grid_t &grid, const std::vector<uint32_t> &changed_tick, uint32_t run, uint64_t tick, uint64_t base_tick)
+{
+    size_t limit = (size_t)grid.rows * grid.cols * 5 / 9;
+    std::vector<size_t> changed;
+    for (uint32_t i = 0; i < grid.rows; i++)
+    {
+        const uint32_t *stamps = &changed_tick[grid.index(i, 0)];
+        for (uint32_t j = 0; j < grid.cols; j++)
+        {
+            if (stamps[j] > base_tick)
+            {
+                if (changed.size() == limit)
+                {
+                    return false;
+                }
+                changed.push_back(grid.index(i, j));
+            }
+        }
+    }
+
+    out.clear();
+    out.reserve(SNAPSHOT_HEADER_SIZE + changed.size() * 9);
+    write_snapshot_header(out, delta, grid, run, tick, base_tick, (uint32_t)changed.size());
+    for (size_t idx : changed)
+    {
+        uint32_t cell = (uint32_t)(idx / grid.stride * grid.cols + idx % grid.stride);
+        out.append(reinterpret_cast<const char *>(&cell), sizeof(cell));
+    }
+    for (size_t idx : changed)
+    {
+        out.append(reinterpret_cast<const char *>(&grid.energy[idx]), sizeof(int16_t));
+    }
+    for (size_t idx : changed)
+    {
+        out.append(reinterpret_cast<const char *>(&grid.age[idx]), sizeof(int16_t));
+    }
+    for (size_t idx : changed)
+    {
+        out.push_back((char)grid.type[idx]);
+    }
+    return true;
+}
+
+// Encodes a snapshot as a delta against the client's last frame (run,
+// base_tick) when the lag is small enough, and as a keyframe otherwise
+inline std::string encode_frame(const snapshot_t &snapshot, bool has_base, uint32_t run, uint64_t base_tick)
+{
+    std::string frame;
+    if (has_base && run == snapshot.run && base_tick <= snapshot.tick && snapshot.tick - base_tick <= MAXIMUM_DELTA_LAG &&
+        encode_delta(frame, snapshot.grid, snapshot.changed_tick, snapshot.run, snapshot.tick, base_tick))
+    {
+        return frame;
+    }
+    return encode_keyframe(snapshot.grid, snapshot.run, snapshot.tick);
+}
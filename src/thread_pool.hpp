@@ -0,0 +1,176 @@
+#pragma once
+
+#include "counted_mutex.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads. The thread calling parallel_for takes
+// part in the work, so a pool of concurrency N owns N - 1 threads.
+class thread_pool_t
+{
+public:
+    explicit thread_pool_t(unsigned concurrency = default_concurrency())
+    {
+        concurrency = std::max(1u, concurrency);
+        for (unsigned k = 1; k < concurrency; k++)
+        {
+            workers.emplace_back([this]()
+                                 { worker_loop(); });
+        }
+    }
+
+    ~thread_pool_t()
+    {
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    thread_pool_t(const thread_pool_t &) = delete;
+    thread_pool_t &operator=(const thread_pool_t &) = delete;
+
+    static unsigned default_concurrency()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    unsigned concurrency() const
+    {
+        return (unsigned)workers.size() + 1;
+    }
+
+    // The lock shared by every submit and worker, for contention metrics
+    const counted_mutex_t &queue_lock() const
+    {
+        return m;
+    }
+
+    // Runs task on a worker, or right away on the calling thread when the
+    // pool owns no threads
+    void submit(std::function<void()> task)
+    {
+        if (workers.empty())
+        {
+            task();
+            return;
+        }
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            tasks.emplace_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    // Calls fn(begin, end) over [0, count) in chunks of at most grain items
+    // and returns once every chunk has run. At most max_concurrency threads,
+    // the caller included, work on the chunks.
+    void parallel_for(uint32_t count, uint32_t grain, const std::function<void(uint32_t, uint32_t)> &fn, unsigned max_concurrency = ~0u)
+    {
+        grain = std::max(1u, grain);
+        uint32_t chunks = (count + grain - 1) / grain;
+        if (chunks == 0)
+        {
+            return;
+        }
+        if (chunks == 1 || workers.empty() || max_concurrency <= 1)
+        {
+            fn(0, count);
+            return;
+        }
+
+        auto job = std::make_shared<job_t>();
+        job->count = count;
+        job->grain = grain;
+        job->chunks = chunks;
+        job->fn = &fn;
+
+        uint32_t helpers = std::min<uint32_t>({chunks - 1, (uint32_t)workers.size(), max_concurrency - 1});
+        {
+            std::lock_guard<counted_mutex_t> guard(m);
+            for (uint32_t k = 0; k < helpers; k++)
+            {
+                tasks.emplace_back([job]()
+                                   { job->run(); });
+            }
+        }
+        cv.notify_all();
+
+        job->run();
+        std::unique_lock<std::mutex> lock(job->m);
+        job->cv.wait(lock, [&]()
+                     { return job->done == job->chunks; });
+    }
+
+private:
+    struct job_t
+    {
+        uint32_t count;
+        uint32_t grain;
+        uint32_t chunks;
+        const std::function<void(uint32_t, uint32_t)> *fn;
+        std::atomic<uint32_t> next{0};
+        uint32_t done = 0;
+        std::mutex m;
+        std::condition_variable cv;
+
+        void run()
+        {
+            uint32_t finished = 0;
+            for (uint32_t chunk = next++; chunk < chunks; chunk = next++)
+            {
+                uint32_t begin = chunk * grain;
+                (*fn)(begin, std::min(count, begin + grain));
+                finished++;
+            }
+            if (finished > 0)
+            {
+                std::lock_guard<std::mutex> guard(m);
+                done += finished;
+                if (done == chunks)
+                {
+                    cv.notify_all();
+                }
+            }
+        }
+    };
+
+    void worker_loop()
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<counted_mutex_t> lock(m);
+                cv.wait(lock, [this]()
+                        { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    counted_mutex_t m;
+    std::condition_variable_any cv;
+    bool stopping = false;
+};